@@ -0,0 +1,384 @@
+// IoAwaitable Protocol - Microbenchmarks
+//
+// Measures the hot paths of d4003-io-awaitables.cpp: frame allocation,
+// co_await chains, synchronous children, generator streams, executor
+// dispatch and run_sync. Each benchmark is
+// repeated for every frame allocator. Self-contained; no benchmark
+// library is required.
+//
+// Compile with: -std=c++20 -O2
+// Run as:       ./bench [filter]
+
+#define CAPY_NO_DEMO_MAIN
+#include "d4003-io-awaitables.cpp"
+
+#include <chrono>
+#include <cstring>
+#include <limits>
+
+namespace capy::bench {
+
+// ============================================================
+// Harness
+// ============================================================
+
+template<class T>
+inline void
+do_not_optimize(T const& v) noexcept
+{
+#if defined(__GNUC__)
+    asm volatile("" : : "r,m"(v) : "memory");
+#else
+    static_cast<void>(*static_cast<T const volatile*>(&v));
+#endif
+}
+
+char const* filter = nullptr;
+
+// Runs f in batches sized to take at least 20 ms and reports the
+// fastest of five batches, in nanoseconds per call
+template<class F>
+void
+run(char const* group, char const* variant, F&& f)
+{
+    char name[128];
+    std::snprintf(name, sizeof(name), "%s/%s", group, variant);
+    if(filter && !std::strstr(name, filter))
+        return;
+
+    using clock = std::chrono::steady_clock;
+    auto batch = [&](std::size_t n) {
+        auto t0 = clock::now();
+        for(std::size_t i = 0; i < n; ++i)
+            f();
+        return std::chrono::duration<double, std::nano>(clock::now() - t0).count();
+    };
+
+    std::size_t n = 1;
+    while(batch(n) < 20e6 && n < (std::size_t(1) << 30))
+        n *= 2;
+    double best = std::numeric_limits<double>::max();
+    for(int i = 0; i < 5; ++i)
+        best = std::min(best, batch(n) / static_cast<double>(n));
+    std::printf("%-56s %12.1f ns\n", name, best);
+}
+
+// ============================================================
+// Frame allocators under test
+// ============================================================
+
+// The allocator installed as current_frame_allocator() and as the
+// context's frame allocator. reset() runs after every iteration, so
+// the monotonic arena models one arena per request.
+struct allocator_config
+{
+    char const* name;
+    std::pmr::memory_resource* mr;
+    std::pmr::monotonic_buffer_resource* arena = nullptr;
+    request_arena* req_arena = nullptr;
+
+    void
+    reset() const noexcept
+    {
+        if(arena)
+            arena->release();
+        if(req_arena)
+            req_arena->reset();
+    }
+};
+
+// ============================================================
+// Coroutines under test
+// ============================================================
+
+task<int> leaf()
+{
+    co_return 1;
+}
+
+task<int, recycled_frames> static_leaf()
+{
+    co_return 1;
+}
+
+task<int> chain(int depth)
+{
+    if(depth == 0)
+        co_return 0;
+    co_return 1 + co_await chain(depth - 1);
+}
+
+leaf_task<int> inline_leaf()
+{
+    co_return 1;
+}
+
+// Children that finish without suspending
+task<int> sum_children(int n)
+{
+    int s = 0;
+    for(int i = 0; i < n; ++i)
+        s += co_await leaf();
+    co_return s;
+}
+
+task<int> sum_leaves(int n)
+{
+    int s = 0;
+    for(int i = 0; i < n; ++i)
+        s += co_await inline_leaf();
+    co_return s;
+}
+
+async_generator<int> numbers(int n)
+{
+    for(int i = 0; i < n; ++i)
+        co_yield i;
+}
+
+task<int> item(int i)
+{
+    co_return i;
+}
+
+// One frame for the whole stream
+task<long> sum_generated(int n)
+{
+    auto g = numbers(n);
+    long s = 0;
+    while(auto* v = co_await g)
+        s += *v;
+    co_return s;
+}
+
+// One frame per item
+task<long> sum_tasks(int n)
+{
+    long s = 0;
+    for(int i = 0; i < n; ++i)
+        s += co_await item(i);
+    co_return s;
+}
+
+// A coroutine that suspends again every time it is resumed, so
+// each resume runs a real frame to its next suspension point
+struct suspender
+{
+    struct promise_type
+    {
+        suspender
+        get_return_object()
+        {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+};
+
+suspender
+suspend_forever()
+{
+    for(;;)
+        co_await std::suspend_always{};
+}
+
+// ============================================================
+// Benchmarks
+// ============================================================
+
+void
+frame_alloc(allocator_config const& cfg)
+{
+    current_frame_allocator() = cfg.mr;
+    run("frame_alloc", cfg.name, [&] {
+        {
+            auto t = leaf();
+            do_not_optimize(t);
+        }
+        cfg.reset();
+    });
+}
+
+void
+frame_alloc_fallbacks()
+{
+    // No allocator installed: operator new falls back to the default
+    // resource through the thread-local lookup
+    current_frame_allocator() = nullptr;
+    run("frame_alloc", "no_current_frame_allocator", [] {
+        auto t = leaf();
+        do_not_optimize(t);
+    });
+
+    // StaticFrameAllocator: no thread-local lookup at all
+    run("frame_alloc", "static_recycled_frames", [] {
+        auto t = static_leaf();
+        do_not_optimize(t);
+    });
+}
+
+void
+await_chain(allocator_config const& cfg)
+{
+    inline_context ctx;
+    ctx.set_frame_allocator(cfg.mr);
+    inline_executor ex{&ctx};
+    current_frame_allocator() = cfg.mr;
+    for(int depth : {1, 10, 100, 1000})
+    {
+        char group[32];
+        std::snprintf(group, sizeof(group), "await_chain_%d", depth);
+        run(group, cfg.name, [&] {
+            do_not_optimize(run_sync(ex, chain(depth)));
+            cfg.reset();
+        });
+    }
+}
+
+void
+launch(allocator_config const& cfg)
+{
+    inline_context ctx;
+    ctx.set_frame_allocator(cfg.mr);
+    inline_executor ex{&ctx};
+    current_frame_allocator() = cfg.mr;
+    run("run_sync", cfg.name, [&] {
+        do_not_optimize(run_sync(ex, leaf()));
+        cfg.reset();
+    });
+}
+
+void
+sync_child(allocator_config const& cfg)
+{
+    inline_context ctx;
+    ctx.set_frame_allocator(cfg.mr);
+    inline_executor ex{&ctx};
+    current_frame_allocator() = cfg.mr;
+    constexpr int n = 100;
+    run("sync_child_100_task", cfg.name, [&] {
+        do_not_optimize(run_sync(ex, sum_children(n)));
+        cfg.reset();
+    });
+    run("sync_child_100_leaf_task", cfg.name, [&] {
+        do_not_optimize(run_sync(ex, sum_leaves(n)));
+        cfg.reset();
+    });
+}
+
+void
+stream(allocator_config const& cfg)
+{
+    inline_context ctx;
+    ctx.set_frame_allocator(cfg.mr);
+    inline_executor ex{&ctx};
+    current_frame_allocator() = cfg.mr;
+    constexpr int n = 1000;
+    run("stream_1000_generator", cfg.name, [&] {
+        do_not_optimize(run_sync(ex, sum_generated(n)));
+        cfg.reset();
+    });
+    run("stream_1000_task_per_item", cfg.name, [&] {
+        do_not_optimize(run_sync(ex, sum_tasks(n)));
+        cfg.reset();
+    });
+}
+
+void
+dispatch()
+{
+    auto coro = suspend_forever();
+    std::coroutine_handle<> h = coro.h;
+    inline_context ctx;
+    inline_executor ex{&ctx};
+    executor_ref ref(ex);
+    any_executor any(ex);
+
+    run("dispatch", "direct_resume", [&] {
+        h.resume();
+        do_not_optimize(h);
+    });
+    run("dispatch", "inline_executor_post", [&] {
+        ex.post(h);
+        do_not_optimize(h);
+    });
+    run("dispatch", "executor_ref_post", [&] {
+        ref.post(h);
+        do_not_optimize(ref);
+    });
+    run("dispatch", "executor_ref_dispatch", [&] {
+        ref.dispatch(h).resume();
+        do_not_optimize(ref);
+    });
+    run("dispatch", "any_executor_post", [&] {
+        any.post(h);
+        do_not_optimize(any);
+    });
+
+    // Queue round trip through a run loop, per handle
+    io_context ioc;
+    auto iex = ioc.get_executor();
+    constexpr int n = 1000;
+    run("dispatch", "io_context_post_run_x1000", [&] {
+        for(int i = 0; i < n; ++i)
+            iex.post(h);
+        do_not_optimize(ioc.run());
+    });
+
+    // The same round trip serialized through a strand
+    strand sex(iex);
+    run("dispatch", "strand_post_run_x1000", [&] {
+        for(int i = 0; i < n; ++i)
+            sex.post(h);
+        do_not_optimize(ioc.run());
+    });
+
+    coro.h.destroy();
+}
+
+int
+main(int argc, char** argv)
+{
+    if(argc > 1)
+        filter = argv[1];
+
+    // release() rewinds into the initial buffer without touching upstream
+    static std::byte arena_buffer[256 * 1024];
+    std::pmr::monotonic_buffer_resource arena(arena_buffer, sizeof(arena_buffer));
+    static std::byte request_buffer[256 * 1024];
+    request_arena req_arena(request_buffer, sizeof(request_buffer));
+    std::pmr::unsynchronized_pool_resource pool;
+    allocator_config const configs[] = {
+        {"default_resource", std::pmr::get_default_resource()},
+        {"recycling_frame_pool", get_recycling_frame_pool()},
+        {"monotonic_buffer_resource", &arena, &arena},
+        {"request_arena", &req_arena, nullptr, &req_arena},
+        {"unsynchronized_pool_resource", &pool},
+    };
+
+    for(auto const& cfg : configs)
+        frame_alloc(cfg);
+    frame_alloc_fallbacks();
+    for(auto const& cfg : configs)
+        await_chain(cfg);
+    for(auto const& cfg : configs)
+        launch(cfg);
+    for(auto const& cfg : configs)
+        sync_child(cfg);
+    for(auto const& cfg : configs)
+        stream(cfg);
+    dispatch();
+
+    current_frame_allocator() = nullptr;
+    return 0;
+}
+
+} // namespace capy::bench
+
+int main(int argc, char** argv) { return capy::bench::main(argc, argv); }
@@ -6,594 +6,7470 @@
 //
 // Compile with: -std=c++20
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <chrono>
 #include <concepts>
+#include <condition_variable>
 #include <coroutine>
 #include <cstddef>
 #include <cstdint>
 #include <exception>
+#include <functional>
+#include <memory>
 #include <memory_resource>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <stdexcept>
 #include <stop_token>
+#include <system_error>
+#include <thread>
+#include <tuple>
 #include <type_traits>
+#include <typeinfo>
 #include <utility>
+#include <variant>
+#include <vector>
 
 #include <cstdio>
+#include <cstring>
 
-// ============================================================
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define CAPY_HAS_IO_URING 1
+#include <cerrno>
+#include <span>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#define CAPY_HAS_IO_URING 0
+#endif
 
-namespace capy {
+#if defined(__linux__) && __has_include(<linux/mempolicy.h>)
+#define CAPY_HAS_NUMA 1
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#define CAPY_HAS_NUMA 0
+#endif
 
-// ============================================================
-// execution_context (minimal for demo)
-// ============================================================
+// Define to 1 to tag every frame allocation with its promise type,
+// visible to memory resources through current_frame_type()
+#ifndef CAPY_FRAME_TRACKING
+#define CAPY_FRAME_TRACKING 0
+#endif
 
-class execution_context
-{
-public:
-    execution_context() = default;
-    virtual ~execution_context() = default;
+// Define to 0 to stop recording the frame sizes seen per promise
+// type in frame_size_registry
+#ifndef CAPY_FRAME_SIZE_REGISTRY
+#define CAPY_FRAME_SIZE_REGISTRY 1
+#endif
 
-    execution_context(execution_context const&) = delete;
-    execution_context& operator=(execution_context const&) = delete;
-};
+// Define to 1 to time suspensions, run-queue delays and tasks for
+// the io_tracer of each io_env. When 0 the hooks compile to nothing.
+#ifndef CAPY_TRACING
+#define CAPY_TRACING 0
+#endif
 
-// ============================================================
-// Executor concept
 // ============================================================
 
-template<class E>
-concept Executor =
-    std::is_nothrow_copy_constructible_v<E> &&
-    std::is_nothrow_move_constructible_v<E> &&
-    requires(E& e, E const& ce, E const& ce2, std::coroutine_handle<> h) {
-        { ce == ce2 } noexcept -> std::convertible_to<bool>;
-        { ce.context() } noexcept;
-        requires std::is_lvalue_reference_v<decltype(ce.context())> &&
-            std::derived_from<
-                std::remove_reference_t<decltype(ce.context())>,
-                execution_context>;
-        { ce.on_work_started() } noexcept;
-        { ce.on_work_finished() } noexcept;
-        { ce.dispatch(h) } -> std::same_as<std::coroutine_handle<>>;
-        { ce.post(h) };
-    };
+namespace capy {
 
 // ============================================================
-// executor_ref (type-erased executor wrapper)
+// numa_topology - CPUs per NUMA node
 // ============================================================
 
 namespace detail {
 
-struct executor_vtable
-{
-    execution_context& (*context)(void const*) noexcept;
-    void (*on_work_started)(void const*) noexcept;
-    void (*on_work_finished)(void const*) noexcept;
-    void (*post)(void const*, std::coroutine_handle<>);
-    std::coroutine_handle<> (*dispatch)(void const*, std::coroutine_handle<>);
-    bool (*equals)(void const*, void const*) noexcept;
-};
+// Depots, and so distinct frame pool homes, are kept for this many
+// nodes; higher node ids share the last one
+inline constexpr unsigned max_numa_nodes = 64;
 
-template<class Ex>
-inline constexpr executor_vtable vtable_for = {
-    [](void const* p) noexcept -> execution_context& {
-        return const_cast<Ex*>(static_cast<Ex const*>(p))->context();
-    },
-    [](void const* p) noexcept {
-        const_cast<Ex*>(static_cast<Ex const*>(p))->on_work_started();
-    },
-    [](void const* p) noexcept {
-        const_cast<Ex*>(static_cast<Ex const*>(p))->on_work_finished();
-    },
-    [](void const* p, std::coroutine_handle<> h) {
-        static_cast<Ex const*>(p)->post(h);
-    },
-    [](void const* p, std::coroutine_handle<> h) -> std::coroutine_handle<> {
-        return static_cast<Ex const*>(p)->dispatch(h);
-    },
-    [](void const* a, void const* b) noexcept -> bool {
-        return *static_cast<Ex const*>(a) == *static_cast<Ex const*>(b);
-    },
-};
+// Parse a sysfs CPU list such as "0-3,8,10-11"
+inline std::vector<unsigned>
+read_cpu_list(char const* path)
+{
+    std::vector<unsigned> cpus;
+    std::FILE* f = std::fopen(path, "r");
+    if(!f)
+        return cpus;
+    unsigned lo, hi;
+    for(;;)
+    {
+        if(std::fscanf(f, "%u", &lo) != 1)
+            break;
+        hi = lo;
+        int c = std::fgetc(f);
+        if(c == '-')
+        {
+            if(std::fscanf(f, "%u", &hi) != 1)
+                break;
+            c = std::fgetc(f);
+        }
+        for(unsigned i = lo; i <= hi; ++i)
+            cpus.push_back(i);
+        if(c != ',')
+            break;
+    }
+    std::fclose(f);
+    return cpus;
+}
 
 } // namespace detail
 
-class executor_ref
+// The machine's NUMA nodes and the CPUs in each, read once from
+// /sys/devices/system/node. Without that information, or on other
+// platforms, there is one node holding every CPU.
+class numa_topology
 {
-    void const* ex_ = nullptr;
-    detail::executor_vtable const* vt_ = nullptr;
-
-public:
-    executor_ref() = default;
-    executor_ref(executor_ref const&) = default;
-    executor_ref& operator=(executor_ref const&) = default;
+    std::vector<std::vector<unsigned>> nodes_;  // indexed by node id
+    std::vector<unsigned> node_of_;             // indexed by CPU
 
-    template<class Ex>
-        requires (!std::same_as<std::decay_t<Ex>, executor_ref>)
-    executor_ref(Ex const& ex) noexcept
-        : ex_(&ex)
-        , vt_(&detail::vtable_for<Ex>)
+    numa_topology()
     {
+#if CAPY_HAS_NUMA
+        for(unsigned n : detail::read_cpu_list("/sys/devices/system/node/online"))
+        {
+            char path[64];
+            std::snprintf(path, sizeof(path),
+                "/sys/devices/system/node/node%u/cpulist", n);
+            if(nodes_.size() <= n)
+                nodes_.resize(n + 1);
+            nodes_[n] = detail::read_cpu_list(path);
+        }
+#endif
+        if(nodes_.empty())
+        {
+            nodes_.resize(1);
+            unsigned n = std::thread::hardware_concurrency();
+            for(unsigned i = 0; i < (n ? n : 1); ++i)
+                nodes_[0].push_back(i);
+        }
+        for(unsigned n = 0; n < nodes_.size(); ++n)
+        {
+            for(unsigned cpu : nodes_[n])
+            {
+                if(node_of_.size() <= cpu)
+                    node_of_.resize(cpu + 1, 0);
+                node_of_[cpu] = n;
+            }
+        }
     }
 
-    explicit operator bool() const noexcept { return ex_ != nullptr; }
+public:
+    static numa_topology const&
+    system()
+    {
+        static numa_topology const t;
+        return t;
+    }
 
-    execution_context& context() const noexcept { return vt_->context(ex_); }
-    void on_work_started() const noexcept { vt_->on_work_started(ex_); }
-    void on_work_finished() const noexcept { vt_->on_work_finished(ex_); }
-    std::coroutine_handle<> dispatch(std::coroutine_handle<> h) const { return vt_->dispatch(ex_, h); }
-    void post(std::coroutine_handle<> h) const { vt_->post(ex_, h); }
+    // One past the highest node id
+    std::size_t node_count() const noexcept { return nodes_.size(); }
 
-    bool operator==(executor_ref const& other) const noexcept
+    std::vector<unsigned> const&
+    cpus(unsigned node) const noexcept
     {
-        if (ex_ == other.ex_)
-            return true;
-        if (vt_ != other.vt_)
-            return false;
-        return vt_->equals(ex_, other.ex_);
+        static std::vector<unsigned> const none;
+        return node < nodes_.size() ? nodes_[node] : none;
     }
-};
 
-// ============================================================
-// io_env - execution environment
-// ============================================================
+    unsigned
+    node_of(unsigned cpu) const noexcept
+    {
+        return cpu < node_of_.size() ? node_of_[cpu] : 0;
+    }
 
-struct io_env
-{
-    executor_ref executor;
-    std::stop_token stop_token;
-    std::pmr::memory_resource* allocator = nullptr;
+    // Every CPU, node by node, so consecutive workers share a node
+    std::vector<unsigned>
+    all_cpus() const
+    {
+        std::vector<unsigned> v;
+        for(auto const& n : nodes_)
+            v.insert(v.end(), n.begin(), n.end());
+        return v;
+    }
 };
 
 // ============================================================
-// this_coro tags
+// recycling_frame_pool - thread-local recycling frame allocator
 // ============================================================
 
-namespace this_coro {
+namespace detail {
 
-struct environment_tag {};
-struct executor_tag {};
-struct stop_token_tag {};
-struct allocator_tag {};
+// Size classes: 16-byte steps up to 512 bytes, then powers of
+// two up to 16 KiB. Anything larger goes straight upstream.
+struct frame_size_class
+{
+    static constexpr std::size_t granule = 16;
+    static constexpr std::size_t small_max = 512;
+    static constexpr std::size_t small_count = small_max / granule;
+    static constexpr std::size_t large_count = 5;
+    static constexpr std::size_t count = small_count + large_count;
+    static constexpr std::size_t max_size = small_max << large_count;
 
-inline constexpr environment_tag environment{};
-inline constexpr executor_tag executor{};
-inline constexpr stop_token_tag stop_token{};
-inline constexpr allocator_tag allocator{};
+    static constexpr std::size_t
+    index(std::size_t n) noexcept
+    {
+        if(n <= small_max)
+            return n == 0 ? 0 : (n + granule - 1) / granule - 1;
+        std::size_t i = small_count;
+        for(std::size_t c = small_max * 2; c < n; c <<= 1)
+            ++i;
+        return i;
+    }
 
-} // namespace this_coro
+    static constexpr std::size_t
+    block_size(std::size_t i) noexcept
+    {
+        if(i < small_count)
+            return (i + 1) * granule;
+        return small_max << (i - small_count + 1);
+    }
+};
 
-// ============================================================
-// current_frame_allocator (thread-local)
-// ============================================================
+static_assert(frame_size_class::index(1) == 0);
+static_assert(frame_size_class::index(512) == 31);
+static_assert(frame_size_class::index(513) == 32);
+static_assert(frame_size_class::index(16384) == frame_size_class::count - 1);
+static_assert(frame_size_class::block_size(32) == 1024);
 
-inline std::pmr::memory_resource*&
-current_frame_allocator() noexcept
+struct free_block
 {
-    static thread_local std::pmr::memory_resource* mr = nullptr;
-    return mr;
-}
+    free_block* next;
+};
 
-// ============================================================
-// IoAwaitable concept
-// ============================================================
+// First granule of every slab. Slabs are aligned to their size, so
+// a block finds its slab, and with it its home node, by masking.
+struct slab_header
+{
+    unsigned node;
+};
 
-template<typename A>
-concept IoAwaitable =
-    requires(
-        A a,
-        std::coroutine_handle<> h,
-        io_env const* env)
-    {
-        a.await_suspend(h, env);
-    };
+inline constexpr std::size_t slab_size = 64 * 1024;
 
-// ============================================================
-// IoRunnable concept
-// ============================================================
+// Set once any thread draws frames from a node other than 0. Until
+// then every block's home is node 0 and frees skip the home lookup.
+inline std::atomic<bool> numa_homes_in_use{false};
 
-template<typename T>
-concept IoRunnable =
-    IoAwaitable<T> &&
-    requires { typename T::promise_type; } &&
-    requires(T& t, T const& ct, typename T::promise_type const& cp)
-    {
-        { ct.handle() } noexcept
-            -> std::same_as<std::coroutine_handle<typename T::promise_type>>;
-        { cp.exception() } noexcept -> std::same_as<std::exception_ptr>;
-        { t.release() } noexcept;
-    } &&
-    (std::is_void_v<decltype(std::declval<T&>().await_resume())> ||
-     requires(typename T::promise_type& p) {
-         p.result();
-     });
+inline unsigned
+slab_node(void const* p) noexcept
+{
+    auto base = reinterpret_cast<std::uintptr_t>(p) & ~(slab_size - 1);
+    return reinterpret_cast<slab_header const*>(base)->node;
+}
 
-// ============================================================
-// io_awaitable_support CRTP mixin
-// ============================================================
+// Map a slab of fresh pages and ask the kernel to back them from
+// node, so first touch from another node cannot misplace them
+inline void*
+allocate_slab(unsigned node)
+{
+#if CAPY_HAS_NUMA
+    void* p = ::mmap(nullptr, 2 * slab_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+        throw std::bad_alloc();
+    auto base = reinterpret_cast<std::uintptr_t>(p);
+    auto slab = (base + slab_size - 1) & ~(slab_size - 1);
+    if(slab != base)
+        ::munmap(p, slab - base);
+    if(slab + slab_size != base + 2 * slab_size)
+        ::munmap(reinterpret_cast<void*>(slab + slab_size),
+            base + slab_size - slab);
+    if(numa_topology::system().node_count() > 1)
+    {
+        unsigned long mask[max_numa_nodes / 64] = {};
+        mask[node / 64] = 1ul << (node % 64);
+        // Best effort; the pages still work if the policy is refused.
+        // The kernel reads maxnode - 1 bits of the mask.
+        ::syscall(SYS_mbind, slab, slab_size, MPOL_PREFERRED,
+            mask, max_numa_nodes + 1, 0);
+    }
+    void* r = reinterpret_cast<void*>(slab);
+#else
+    void* r = ::operator new(slab_size, std::align_val_t{slab_size});
+#endif
+    ::new(r) slab_header{node};
+    return r;
+}
 
-template<typename Derived>
-class io_awaitable_support
+inline void
+free_slab(void* p) noexcept
 {
-    io_env const* env_ = nullptr;
-    mutable std::coroutine_handle<> cont_{std::noop_coroutine()};
+#if CAPY_HAS_NUMA
+    ::munmap(p, slab_size);
+#else
+    ::operator delete(p, slab_size, std::align_val_t{slab_size});
+#endif
+}
 
-    static constexpr std::size_t ptr_alignment = alignof(void*);
+// Backing store of one NUMA node: owns the node's slabs and holds
+// the blocks that thread caches spill when they grow too large or
+// when their thread exits, and blocks freed on other nodes.
+class frame_pool_depot
+{
+    std::mutex mtx_;
+    free_block* lists_[frame_size_class::count] = {};
+    std::vector<void*> slabs_;
+    char* cur_ = nullptr;       // carved by threads without a cache
+    char* end_ = nullptr;
 
-    static std::size_t
-    aligned_offset(std::size_t n) noexcept
+    std::pair<char*, char*>
+    new_slab_locked(unsigned node)
     {
-        return (n + ptr_alignment - 1) & ~(ptr_alignment - 1);
+        void* p = allocate_slab(node);
+        try
+        {
+            slabs_.push_back(p);
+        }
+        catch(...)
+        {
+            free_slab(p);
+            throw;
+        }
+        auto* c = static_cast<char*>(p);
+        return {c + frame_size_class::granule, c + slab_size};
     }
 
 public:
-    static void*
-    operator new(std::size_t size)
+    ~frame_pool_depot()
     {
-        auto* mr = current_frame_allocator();
-        if(!mr)
-            mr = std::pmr::get_default_resource();
-
-        std::size_t ptr_offset = aligned_offset(size);
-        std::size_t total = ptr_offset + sizeof(std::pmr::memory_resource*);
-        void* raw = mr->allocate(total, alignof(std::max_align_t));
-
-        auto* ptr_loc = reinterpret_cast<std::pmr::memory_resource**>(
-            static_cast<char*>(raw) + ptr_offset);
-        *ptr_loc = mr;
+        for(void* p : slabs_)
+            free_slab(p);
+    }
 
-        return raw;
+    static frame_pool_depot&
+    get(unsigned node) noexcept
+    {
+        static frame_pool_depot depots[max_numa_nodes];
+        return depots[node];
     }
 
-    static void
-    operator delete(void* ptr, std::size_t size)
+    std::pair<char*, char*>
+    new_slab(unsigned node)
     {
-        std::size_t ptr_offset = aligned_offset(size);
-        auto* ptr_loc = reinterpret_cast<std::pmr::memory_resource**>(
-            static_cast<char*>(ptr) + ptr_offset);
-        auto* mr = *ptr_loc;
+        std::lock_guard<std::mutex> lock(mtx_);
+        return new_slab_locked(node);
+    }
 
-        std::size_t total = ptr_offset + sizeof(std::pmr::memory_resource*);
-        mr->deallocate(ptr, total, alignof(std::max_align_t));
+    // For threads whose cache is gone: one block, under the lock
+    void*
+    allocate(std::size_t i, unsigned node)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if(free_block* b = lists_[i])
+        {
+            lists_[i] = b->next;
+            return b;
+        }
+        std::size_t n = frame_size_class::block_size(i);
+        if(static_cast<std::size_t>(end_ - cur_) < n)
+            std::tie(cur_, end_) = new_slab_locked(node);
+        return std::exchange(cur_, cur_ + n);
     }
 
-    ~io_awaitable_support()
+    // Carve count blocks of class i ahead of use. Each is written in
+    // full so its pages are faulted in now rather than under load.
+    void
+    reserve(std::size_t i, std::size_t count, unsigned node)
     {
-        if(cont_ != std::noop_coroutine())
-            cont_.destroy();
+        std::size_t n = frame_size_class::block_size(i);
+        std::lock_guard<std::mutex> lock(mtx_);
+        for(std::size_t k = 0; k < count; ++k)
+        {
+            if(static_cast<std::size_t>(end_ - cur_) < n)
+                std::tie(cur_, end_) = new_slab_locked(node);
+            auto* b = reinterpret_cast<free_block*>(std::exchange(cur_, cur_ + n));
+            std::memset(b, 0, n);
+            b->next = lists_[i];
+            lists_[i] = b;
+        }
     }
 
-    void set_continuation(std::coroutine_handle<> cont) noexcept
+    // Detach the whole free list for class i
+    free_block*
+    take(std::size_t i) noexcept
     {
-        cont_ = cont;
+        std::lock_guard<std::mutex> lock(mtx_);
+        return std::exchange(lists_[i], nullptr);
     }
 
-    std::coroutine_handle<> continuation() const noexcept
+    void
+    give(std::size_t i, free_block* head, free_block* tail) noexcept
     {
-        return std::exchange(cont_, std::noop_coroutine());
+        std::lock_guard<std::mutex> lock(mtx_);
+        tail->next = lists_[i];
+        lists_[i] = head;
     }
+};
 
-    void set_environment(io_env const* env) noexcept
+// Per-thread free lists plus the tail of the slab this
+// thread is currently carving from. Blocks come from the depot of
+// the thread's node and go back to their home depot when freed on
+// another node, so a node's frames stay in its memory.
+class frame_pool_cache
+{
+    static constexpr std::size_t max_cached = 256;
+
+    free_block* lists_[frame_size_class::count] = {};
+    std::size_t counts_[frame_size_class::count] = {};
+    char* cur_ = nullptr;
+    char* end_ = nullptr;
+    unsigned node_ = 0;
+
+    static bool&
+    destroyed() noexcept
     {
-        env_ = env;
+        static thread_local bool b = false;
+        return b;
     }
 
-    io_env const* environment() const noexcept
+public:
+    ~frame_pool_cache()
     {
-        return env_;
+        for(std::size_t i = 0; i < frame_size_class::count; ++i)
+            spill(i);
+        destroyed() = true;
     }
 
-    template<typename A>
-    decltype(auto) transform_awaitable(A&& a)
+    // Returns nullptr once this thread's cache is gone, so frames
+    // released by later thread_local destructors still have a home.
+    static frame_pool_cache*
+    get() noexcept
     {
-        return std::forward<A>(a);
+        if(destroyed())
+            return nullptr;
+        static thread_local frame_pool_cache cache;
+        return &cache;
     }
 
-    template<typename T>
-    auto await_transform(T&& t)
+    unsigned node() const noexcept { return node_; }
+
+    // Draw later blocks from node. Cached blocks go back to the old
+    // node's depot; the slab tail is still carved until used up, as
+    // its blocks know their home.
+    void
+    set_node(unsigned node) noexcept
     {
-        using Tag = std::decay_t<T>;
+        node = std::min(node, max_numa_nodes - 1);
+        if(node == node_)
+            return;
+        for(std::size_t i = 0; i < frame_size_class::count; ++i)
+            spill(i);
+        node_ = node;
+        if(node != 0)
+            numa_homes_in_use.store(true, std::memory_order_relaxed);
+    }
 
-        if constexpr (std::is_same_v<Tag, this_coro::environment_tag>)
+    void*
+    allocate(std::size_t i)
+    {
+        if(free_block* b = lists_[i])
         {
-            struct awaiter
-            {
-                io_env const* env_;
-                bool await_ready() const noexcept { return true; }
-                void await_suspend(std::coroutine_handle<>) const noexcept {}
-                io_env const* await_resume() const noexcept { return env_; }
-            };
-            return awaiter{env_};
+            lists_[i] = b->next;
+            --counts_[i];
+            return b;
         }
-        else if constexpr (std::is_same_v<Tag, this_coro::executor_tag>)
+        if(free_block* b = frame_pool_depot::get(node_).take(i))
         {
-            struct awaiter
-            {
-                executor_ref executor_;
-                bool await_ready() const noexcept { return true; }
+            lists_[i] = b->next;
+            for(auto* p = b->next; p; p = p->next)
+                ++counts_[i];
+            return b;
+        }
+        std::size_t n = frame_size_class::block_size(i);
+        if(static_cast<std::size_t>(end_ - cur_) < n)
+            std::tie(cur_, end_) = frame_pool_depot::get(node_).new_slab(node_);
+        return std::exchange(cur_, cur_ + n);
+    }
+
+    void
+    deallocate(void* p, std::size_t i) noexcept
+    {
+        auto* b = static_cast<free_block*>(p);
+        if(numa_homes_in_use.load(std::memory_order_relaxed))
+        {
+            unsigned home = slab_node(p);
+            if(home != node_)
+                return frame_pool_depot::get(home).give(i, b, b);
+        }
+        b->next = lists_[i];
+        lists_[i] = b;
+        if(++counts_[i] > max_cached)
+            spill(i);
+    }
+
+private:
+    void
+    spill(std::size_t i) noexcept
+    {
+        free_block* head = lists_[i];
+        if(!head)
+            return;
+        free_block* tail = head;
+        while(tail->next)
+            tail = tail->next;
+        frame_pool_depot::get(node_).give(i, head, tail);
+        lists_[i] = nullptr;
+        counts_[i] = 0;
+    }
+};
+
+} // namespace detail
+
+// A memory_resource that recycles coroutine frames through
+// per-thread free lists keyed on the rounded frame size. Blocks
+// are carved from 64 KiB slabs and never returned upstream until
+// program exit, so a frame may be freed on a different thread
+// than the one that allocated it. Slabs belong to the NUMA node of
+// the thread that carved them, set by contexts that pin threads.
+// Requests larger than 16 KiB or over-aligned requests fall
+// through to the global operator new.
+class recycling_frame_pool final
+    : public std::pmr::memory_resource
+{
+public:
+    static void*
+    allocate_frame(std::size_t n)
+    {
+        if(n > detail::frame_size_class::max_size)
+            return ::operator new(n);
+        auto i = detail::frame_size_class::index(n);
+        if(auto* c = detail::frame_pool_cache::get())
+            return c->allocate(i);
+        return detail::frame_pool_depot::get(0).allocate(i, 0);
+    }
+
+    // Carve count blocks for frames of n bytes into the depot of the
+    // calling thread's node and touch their pages, so that frames
+    // allocated later find them ready
+    static void
+    reserve(std::size_t n, std::size_t count)
+    {
+        if(n > detail::frame_size_class::max_size)
+            return;
+        auto* c = detail::frame_pool_cache::get();
+        unsigned node = c ? c->node() : 0;
+        detail::frame_pool_depot::get(node).reserve(
+            detail::frame_size_class::index(n), count, node);
+    }
+
+    static void
+    deallocate_frame(void* p, std::size_t n) noexcept
+    {
+        if(n > detail::frame_size_class::max_size)
+            return ::operator delete(p);
+        auto i = detail::frame_size_class::index(n);
+        if(auto* c = detail::frame_pool_cache::get())
+            return c->deallocate(p, i);
+        auto* b = static_cast<detail::free_block*>(p);
+        detail::frame_pool_depot::get(detail::slab_node(p)).give(i, b, b);
+    }
+
+private:
+    void*
+    do_allocate(std::size_t n, std::size_t align) override
+    {
+        if(align > detail::frame_size_class::granule)
+            return ::operator new(n, std::align_val_t{align});
+        return allocate_frame(n);
+    }
+
+    void
+    do_deallocate(void* p, std::size_t n, std::size_t align) override
+    {
+        if(align > detail::frame_size_class::granule)
+            return ::operator delete(p, std::align_val_t{align});
+        deallocate_frame(p, n);
+    }
+
+    bool
+    do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+inline recycling_frame_pool*
+get_recycling_frame_pool() noexcept
+{
+    static recycling_frame_pool pool;
+    return &pool;
+}
+
+// ============================================================
+// request_arena - bump allocator released in one go
+// ============================================================
+
+// Memory resource for the frames of one request. Allocation bumps a
+// pointer through an initial buffer, typically on the launcher's
+// stack, then through slabs chained from upstream only on overflow.
+// deallocate() does nothing; reset() rewinds to the initial buffer
+// and frees the slabs. Frames allocated from an arena are tagged, so
+// frame deletion skips the call to deallocate altogether.
+class request_arena final : public std::pmr::memory_resource
+{
+    struct slab
+    {
+        slab* next;
+        std::size_t size;
+    };
+
+    std::byte* buf_;
+    std::size_t buf_size_;
+    std::byte* cur_;
+    std::byte* end_;
+    slab* slabs_ = nullptr;
+    std::size_t next_slab_size_;
+    std::pmr::memory_resource* upstream_;
+
+    void*
+    grow(std::size_t n, std::size_t align)
+    {
+        std::size_t need = sizeof(slab) + n + align;
+        std::size_t size = std::max(next_slab_size_, need);
+        void* raw = upstream_->allocate(size, alignof(std::max_align_t));
+        slabs_ = ::new(raw) slab{slabs_, size};
+        next_slab_size_ = size * 2;
+        cur_ = reinterpret_cast<std::byte*>(slabs_ + 1);
+        end_ = static_cast<std::byte*>(raw) + size;
+        void* p = cur_;
+        std::size_t space = static_cast<std::size_t>(end_ - cur_);
+        std::align(align, n, p, space);
+        return p;
+    }
+
+    void*
+    do_allocate(std::size_t n, std::size_t align) override
+    {
+        void* p = cur_;
+        std::size_t space = static_cast<std::size_t>(end_ - cur_);
+        if(!std::align(align, n, p, space))
+            p = grow(n, align);
+        cur_ = static_cast<std::byte*>(p) + n;
+        return p;
+    }
+
+    void
+    do_deallocate(void*, std::size_t, std::size_t) noexcept override
+    {
+    }
+
+    bool
+    do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+public:
+    request_arena(void* buffer, std::size_t size,
+        std::pmr::memory_resource* upstream = std::pmr::new_delete_resource()) noexcept
+        : buf_(static_cast<std::byte*>(buffer))
+        , buf_size_(size)
+        , cur_(buf_)
+        , end_(buf_ + size)
+        , next_slab_size_(std::max<std::size_t>(size, 4096))
+        , upstream_(upstream)
+    {
+    }
+
+    request_arena(request_arena const&) = delete;
+    request_arena& operator=(request_arena const&) = delete;
+
+    ~request_arena()
+    {
+        reset();
+    }
+
+    // Release everything allocated since construction or the last
+    // reset. No frame from the arena may still be alive.
+    void
+    reset() noexcept
+    {
+        while(slabs_)
+        {
+            slab* s = std::exchange(slabs_, slabs_->next);
+            upstream_->deallocate(s, s->size, alignof(std::max_align_t));
+        }
+        cur_ = buf_;
+        end_ = buf_ + buf_size_;
+        next_slab_size_ = std::max<std::size_t>(buf_size_, 4096);
+    }
+
+    // True when nothing has been allocated since the last reset
+    bool
+    empty() const noexcept
+    {
+        return cur_ == buf_ && !slabs_;
+    }
+};
+
+// ============================================================
+// execution_context
+// ============================================================
+
+class service_already_exists : public std::logic_error
+{
+public:
+    service_already_exists()
+        : std::logic_error("service already exists")
+    {
+    }
+};
+
+#if CAPY_TRACING
+class io_tracer;
+#endif
+
+namespace detail {
+
+// Address identifies a service type without RTTI
+template<class T>
+inline constexpr char service_key = 0;
+
+} // namespace detail
+
+class execution_context
+{
+public:
+    class service
+    {
+        friend class execution_context;
+
+    public:
+        virtual ~service() = default;
+
+    protected:
+        service() = default;
+        virtual void shutdown() = 0;
+    };
+
+private:
+    struct service_entry
+    {
+        void const* key;
+        std::unique_ptr<service> svc;
+        bool shut = false;
+    };
+
+    mutable std::mutex services_mtx_;
+    std::vector<service_entry> services_;   // in order of addition
+    std::pmr::memory_resource* frame_alloc_ = nullptr;
+    std::atomic<void (*)(std::exception_ptr) noexcept> on_exception_{nullptr};
+#if CAPY_TRACING
+    std::atomic<io_tracer*> tracer_{nullptr};
+#endif
+
+    service*
+    find_locked(void const* key) const noexcept
+    {
+        for(auto const& e : services_)
+            if(e.key == key)
+                return e.svc.get();
+        return nullptr;
+    }
+
+public:
+    execution_context() = default;
+
+    // Derived contexts whose services touch derived state call
+    // shutdown() and destroy() from their own destructors first
+    virtual ~execution_context()
+    {
+        shutdown();
+        destroy();
+    }
+
+    execution_context(execution_context const&) = delete;
+    execution_context& operator=(execution_context const&) = delete;
+
+    template<class T>
+    bool
+    has_service() const noexcept
+    {
+        return find_service<T>() != nullptr;
+    }
+
+    template<class T>
+    T*
+    find_service() const noexcept
+    {
+        std::lock_guard<std::mutex> lock(services_mtx_);
+        return static_cast<T*>(find_locked(&detail::service_key<T>));
+    }
+
+    // The service is constructed outside the lock so its constructor
+    // may use other services; a racing creator's instance is dropped
+    template<class T>
+    T&
+    use_service()
+    {
+        if(T* svc = find_service<T>())
+            return *svc;
+        auto svc = std::make_unique<T>(*this);
+        std::lock_guard<std::mutex> lock(services_mtx_);
+        if(auto* existing = find_locked(&detail::service_key<T>))
+            return *static_cast<T*>(existing);
+        T& r = *svc;
+        services_.push_back({&detail::service_key<T>, std::move(svc)});
+        return r;
+    }
+
+    template<class T, class... Args>
+    T&
+    make_service(Args&&... args)
+    {
+        auto svc = std::make_unique<T>(*this, std::forward<Args>(args)...);
+        std::lock_guard<std::mutex> lock(services_mtx_);
+        if(find_locked(&detail::service_key<T>))
+            throw service_already_exists();
+        T& r = *svc;
+        services_.push_back({&detail::service_key<T>, std::move(svc)});
+        return r;
+    }
+
+    // Default allocator for frames launched on this context
+    std::pmr::memory_resource*
+    get_frame_allocator() const noexcept
+    {
+        return frame_alloc_ ? frame_alloc_ : get_recycling_frame_pool();
+    }
+
+    void
+    set_frame_allocator(std::pmr::memory_resource* mr) noexcept
+    {
+        frame_alloc_ = mr;
+    }
+
+    // Receives exceptions escaping detached work; nobody is left to
+    // rethrow them. Without a handler the process terminates.
+    using exception_handler = void (*)(std::exception_ptr) noexcept;
+
+    void
+    set_exception_handler(exception_handler h) noexcept
+    {
+        on_exception_.store(h, std::memory_order_release);
+    }
+
+    void
+    handle_exception(std::exception_ptr ep) noexcept
+    {
+        if(auto h = on_exception_.load(std::memory_order_acquire))
+            h(std::move(ep));
+        else
+            std::terminate();
+    }
+
+#if CAPY_TRACING
+    // Installed in the io_env of work launched on this context
+    io_tracer* tracer() const noexcept { return tracer_.load(std::memory_order_acquire); }
+
+    void
+    set_tracer(io_tracer* t) noexcept
+    {
+        tracer_.store(t, std::memory_order_release);
+    }
+#endif
+
+protected:
+    // Shut services down in reverse order of addition, once each
+    void
+    shutdown() noexcept
+    {
+        for(auto it = services_.rbegin(); it != services_.rend(); ++it)
+        {
+            if(!std::exchange(it->shut, true))
+                it->svc->shutdown();
+        }
+    }
+
+    void
+    destroy() noexcept
+    {
+        while(!services_.empty())
+            services_.pop_back();
+    }
+};
+
+// ============================================================
+// Executor concept
+// ============================================================
+
+template<class E>
+concept Executor =
+    std::is_nothrow_copy_constructible_v<E> &&
+    std::is_nothrow_move_constructible_v<E> &&
+    requires(E& e, E const& ce, E const& ce2, std::coroutine_handle<> h) {
+        { ce == ce2 } noexcept -> std::convertible_to<bool>;
+        { ce.context() } noexcept;
+        requires std::is_lvalue_reference_v<decltype(ce.context())> &&
+            std::derived_from<
+                std::remove_reference_t<decltype(ce.context())>,
+                execution_context>;
+        { ce.on_work_started() } noexcept;
+        { ce.on_work_finished() } noexcept;
+        { ce.dispatch(h) } -> std::same_as<std::coroutine_handle<>>;
+        { ce.post(h) };
+    };
+
+// ============================================================
+// ExecutionContext concept
+// ============================================================
+
+template<class X>
+concept ExecutionContext =
+    std::derived_from<X, execution_context> &&
+    requires(X& x) {
+        typename X::executor_type;
+        requires Executor<typename X::executor_type>;
+        { x.get_executor() } noexcept -> std::same_as<typename X::executor_type>;
+    };
+
+// ============================================================
+// executor_ref (type-erased executor wrapper)
+// ============================================================
+
+namespace detail {
+
+struct executor_vtable
+{
+    execution_context& (*context)(void const*) noexcept;
+    void (*on_work_started)(void const*) noexcept;
+    void (*on_work_finished)(void const*) noexcept;
+    void (*post)(void const*, std::coroutine_handle<>);
+    std::coroutine_handle<> (*dispatch)(void const*, std::coroutine_handle<>);
+    bool (*equals)(void const*, void const*) noexcept;
+};
+
+template<class Ex>
+inline constexpr executor_vtable vtable_for = {
+    [](void const* p) noexcept -> execution_context& {
+        return const_cast<Ex*>(static_cast<Ex const*>(p))->context();
+    },
+    [](void const* p) noexcept {
+        const_cast<Ex*>(static_cast<Ex const*>(p))->on_work_started();
+    },
+    [](void const* p) noexcept {
+        const_cast<Ex*>(static_cast<Ex const*>(p))->on_work_finished();
+    },
+    [](void const* p, std::coroutine_handle<> h) {
+        static_cast<Ex const*>(p)->post(h);
+    },
+    [](void const* p, std::coroutine_handle<> h) -> std::coroutine_handle<> {
+        return static_cast<Ex const*>(p)->dispatch(h);
+    },
+    [](void const* a, void const* b) noexcept -> bool {
+        return *static_cast<Ex const*>(a) == *static_cast<Ex const*>(b);
+    },
+};
+
+} // namespace detail
+
+template<class... Known>
+class basic_any_executor;
+
+class executor_ref
+{
+    void const* ex_ = nullptr;
+    detail::executor_vtable const* vt_ = nullptr;
+
+public:
+    executor_ref() = default;
+    executor_ref(executor_ref const&) = default;
+    executor_ref& operator=(executor_ref const&) = default;
+
+    template<class Ex>
+        requires (!std::same_as<std::decay_t<Ex>, executor_ref>)
+    executor_ref(Ex const& ex) noexcept
+        : ex_(&ex)
+        , vt_(&detail::vtable_for<Ex>)
+    {
+    }
+
+    // Refers to the executor stored inside the any_executor
+    template<class... Known>
+    executor_ref(basic_any_executor<Known...> const& ex) noexcept;
+
+    explicit operator bool() const noexcept { return ex_ != nullptr; }
+
+    execution_context& context() const noexcept { return vt_->context(ex_); }
+    void on_work_started() const noexcept { vt_->on_work_started(ex_); }
+    void on_work_finished() const noexcept { vt_->on_work_finished(ex_); }
+    std::coroutine_handle<> dispatch(std::coroutine_handle<> h) const { return vt_->dispatch(ex_, h); }
+    void post(std::coroutine_handle<> h) const { vt_->post(ex_, h); }
+
+    bool operator==(executor_ref const& other) const noexcept
+    {
+        if (ex_ == other.ex_)
+            return true;
+        if (vt_ != other.vt_)
+            return false;
+        return vt_->equals(ex_, other.ex_);
+    }
+};
+
+// ============================================================
+// inplace_stop_token - non-owning stop token
+// ============================================================
+
+// After P2300's inplace_stop_source. The source owns the stop state
+// in place and is neither copyable nor movable; tokens are a plain
+// pointer to it, so copying one touches no shared reference count.
+// The source must outlive its tokens and callbacks. The owning
+// std::stop_token is only used at the launch boundary, where
+// run_sync carries its requests into an inplace_stop_source.
+
+class inplace_stop_source;
+class inplace_stop_token;
+
+template<class F>
+class inplace_stop_callback;
+
+namespace detail {
+
+struct inplace_stop_callback_base
+{
+    void (*execute_)(inplace_stop_callback_base*) noexcept;
+    inplace_stop_source const* source_;
+    inplace_stop_callback_base* next_ = nullptr;
+    inplace_stop_callback_base** prev_ = nullptr;
+    bool* removed_during_callback_ = nullptr;
+    std::atomic<bool> callback_completed_{false};
+
+    inplace_stop_callback_base(
+        inplace_stop_source const* source,
+        void (*execute)(inplace_stop_callback_base*) noexcept) noexcept
+        : execute_(execute)
+        , source_(source)
+    {
+    }
+
+    void register_callback() noexcept;
+};
+
+} // namespace detail
+
+class inplace_stop_token
+{
+    friend class inplace_stop_source;
+
+    template<class F>
+    friend class inplace_stop_callback;
+
+    inplace_stop_source const* source_ = nullptr;
+
+    explicit inplace_stop_token(inplace_stop_source const* source) noexcept
+        : source_(source)
+    {
+    }
+
+public:
+    template<class F>
+    using callback_type = inplace_stop_callback<F>;
+
+    inplace_stop_token() = default;
+
+    bool stop_requested() const noexcept;
+
+    bool stop_possible() const noexcept { return source_ != nullptr; }
+
+    bool operator==(inplace_stop_token const&) const noexcept = default;
+};
+
+// Callbacks are linked into the source intrusively, under a spin
+// lock held only for list updates; request_stop runs them unlocked.
+class inplace_stop_source
+{
+    friend struct detail::inplace_stop_callback_base;
+
+    template<class F>
+    friend class inplace_stop_callback;
+
+    static constexpr std::uint8_t stop_requested_flag = 1;
+    static constexpr std::uint8_t locked_flag = 2;
+
+    mutable std::atomic<std::uint8_t> state_{0};
+    mutable detail::inplace_stop_callback_base* callbacks_ = nullptr;
+    std::thread::id notifying_thread_;
+
+    std::uint8_t
+    lock() const noexcept
+    {
+        auto old = state_.load(std::memory_order_relaxed);
+        do
+        {
+            while(old & locked_flag)
+            {
+                std::this_thread::yield();
+                old = state_.load(std::memory_order_relaxed);
+            }
+        }
+        while(!state_.compare_exchange_weak(old, old | locked_flag,
+            std::memory_order_acquire, std::memory_order_relaxed));
+        return old;
+    }
+
+    void
+    unlock(std::uint8_t s) const noexcept
+    {
+        state_.store(s, std::memory_order_release);
+    }
+
+    // Fails once stop has been requested
+    bool
+    try_lock_unless_stop_requested(bool set_stop) const noexcept
+    {
+        auto old = state_.load(std::memory_order_relaxed);
+        do
+        {
+            for(;;)
+            {
+                if(old & stop_requested_flag)
+                    return false;
+                if(old == 0)
+                    break;
+                std::this_thread::yield();
+                old = state_.load(std::memory_order_relaxed);
+            }
+        }
+        while(!state_.compare_exchange_weak(old,
+            set_stop ? (locked_flag | stop_requested_flag) : locked_flag,
+            std::memory_order_acq_rel, std::memory_order_relaxed));
+        return true;
+    }
+
+    bool
+    try_add(detail::inplace_stop_callback_base* cb) const noexcept
+    {
+        if(!try_lock_unless_stop_requested(false))
+            return false;
+        cb->next_ = callbacks_;
+        cb->prev_ = &callbacks_;
+        if(callbacks_)
+            callbacks_->prev_ = &cb->next_;
+        callbacks_ = cb;
+        unlock(0);
+        return true;
+    }
+
+    // Unlinks cb, or waits for it to finish if it is running on
+    // another thread. A callback may deregister itself while running.
+    void
+    remove(detail::inplace_stop_callback_base* cb) const noexcept
+    {
+        auto old = lock();
+        if(cb->prev_)
+        {
+            *cb->prev_ = cb->next_;
+            if(cb->next_)
+                cb->next_->prev_ = cb->prev_;
+            unlock(old);
+            return;
+        }
+        auto notifier = notifying_thread_;
+        unlock(old);
+        if(notifier == std::this_thread::get_id())
+        {
+            if(cb->removed_during_callback_)
+                *cb->removed_during_callback_ = true;
+        }
+        else
+        {
+            while(!cb->callback_completed_.load(std::memory_order_acquire))
+                std::this_thread::yield();
+        }
+    }
+
+public:
+    inplace_stop_source() = default;
+
+    ~inplace_stop_source()
+    {
+        assert((state_.load(std::memory_order_relaxed) & locked_flag) == 0);
+        assert(callbacks_ == nullptr);
+    }
+
+    inplace_stop_source(inplace_stop_source const&) = delete;
+    inplace_stop_source& operator=(inplace_stop_source const&) = delete;
+
+    inplace_stop_token get_token() const noexcept { return inplace_stop_token(this); }
+
+    bool
+    stop_requested() const noexcept
+    {
+        return state_.load(std::memory_order_acquire) & stop_requested_flag;
+    }
+
+    // Runs every registered callback on the calling thread. Returns
+    // false if stop had already been requested.
+    bool
+    request_stop() noexcept
+    {
+        if(!try_lock_unless_stop_requested(true))
+            return false;
+        notifying_thread_ = std::this_thread::get_id();
+        while(auto* cb = callbacks_)
+        {
+            cb->prev_ = nullptr;
+            callbacks_ = cb->next_;
+            if(callbacks_)
+                callbacks_->prev_ = &callbacks_;
+            unlock(stop_requested_flag);
+
+            bool removed = false;
+            cb->removed_during_callback_ = &removed;
+            cb->execute_(cb);
+            if(!removed)
+            {
+                cb->removed_during_callback_ = nullptr;
+                cb->callback_completed_.store(true, std::memory_order_release);
+            }
+            lock();
+        }
+        unlock(stop_requested_flag);
+        return true;
+    }
+};
+
+inline bool
+inplace_stop_token::stop_requested() const noexcept
+{
+    return source_ && source_->stop_requested();
+}
+
+inline void
+detail::inplace_stop_callback_base::register_callback() noexcept
+{
+    if(!source_)
+        return;
+    if(!source_->try_add(this))
+    {
+        source_ = nullptr;
+        execute_(this);
+    }
+}
+
+// Invokes f when stop is requested, or at construction if it already
+// was. The destructor deregisters, waiting for f to return if it is
+// running on another thread.
+template<class F>
+class inplace_stop_callback
+    : detail::inplace_stop_callback_base
+{
+    F f_;
+
+    static void
+    execute(detail::inplace_stop_callback_base* base) noexcept
+    {
+        std::move(static_cast<inplace_stop_callback*>(base)->f_)();
+    }
+
+public:
+    template<class Init>
+        requires std::constructible_from<F, Init>
+    explicit
+    inplace_stop_callback(inplace_stop_token token, Init&& init)
+        noexcept(std::is_nothrow_constructible_v<F, Init>)
+        : inplace_stop_callback_base(token.source_, &execute)
+        , f_(std::forward<Init>(init))
+    {
+        register_callback();
+    }
+
+    ~inplace_stop_callback()
+    {
+        if(source_)
+            source_->remove(this);
+    }
+
+    inplace_stop_callback(inplace_stop_callback const&) = delete;
+    inplace_stop_callback& operator=(inplace_stop_callback const&) = delete;
+};
+
+template<class F>
+inplace_stop_callback(inplace_stop_token, F) -> inplace_stop_callback<F>;
+
+namespace detail {
+
+// Stop callback that forwards a request to another source
+template<class Source>
+struct stop_forwarder
+{
+    Source* source;
+
+    void operator()() const noexcept
+    {
+        source->request_stop();
+    }
+};
+
+// The stop callback type for a stoppable token: its callback_type
+// member, as P2300 tokens provide, or std::stop_callback
+template<class Token, class F>
+struct stop_callback_for
+{
+    using type = typename Token::template callback_type<F>;
+};
+
+template<class F>
+struct stop_callback_for<std::stop_token, F>
+{
+    using type = std::stop_callback<F>;
+};
+
+// Carries requests on a foreign stop token into an
+// inplace_stop_source for the duration of a launch. Tokens are
+// empty when the foreign token can never be stopped.
+template<class Token = std::stop_token>
+class stop_bridge
+{
+    using callback = typename stop_callback_for<Token,
+        stop_forwarder<inplace_stop_source>>::type;
+
+    inplace_stop_source source_;
+    std::optional<callback> cb_;
+
+public:
+    explicit
+    stop_bridge(Token const& token)
+    {
+        if(token.stop_possible())
+            cb_.emplace(token, stop_forwarder<inplace_stop_source>{&source_});
+    }
+
+    stop_bridge(stop_bridge const&) = delete;
+    stop_bridge& operator=(stop_bridge const&) = delete;
+
+    inplace_stop_token
+    get_token() const noexcept
+    {
+        return cb_ ? source_.get_token() : inplace_stop_token{};
+    }
+};
+
+// Already the token io_env carries
+template<>
+class stop_bridge<inplace_stop_token>
+{
+    inplace_stop_token token_;
+
+public:
+    explicit
+    stop_bridge(inplace_stop_token token) noexcept
+        : token_(token)
+    {
+    }
+
+    inplace_stop_token get_token() const noexcept { return token_; }
+};
+
+} // namespace detail
+
+// ============================================================
+// io_env - execution environment
+// ============================================================
+
+class buffer_pool;
+
+struct io_env
+{
+    executor_ref executor;
+    inplace_stop_token stop_token;
+    std::pmr::memory_resource* allocator = nullptr;
+    buffer_pool* buffers = nullptr;     // for reads into pooled buffers
+#if CAPY_TRACING
+    io_tracer* tracer = nullptr;
+#endif
+};
+
+#if CAPY_TRACING
+
+// ============================================================
+// Tracing - suspend, resume and scheduling latency
+// ============================================================
+
+using trace_clock = std::chrono::steady_clock;
+
+enum class trace_kind
+{
+    await,      // suspension to readiness, or to resumption when the
+                // awaitable does not report when it became ready
+    schedule,   // readiness to resumption: time in the run queue
+    task        // first resumption of a task to its final suspend
+};
+
+struct trace_event
+{
+    trace_kind kind;
+    std::type_info const* type;     // awaitable or promise type
+    execution_context* context;     // where the coroutine resumed
+    std::chrono::nanoseconds duration;
+};
+
+// Receives the events of every coroutine whose io_env carries it,
+// on the thread that resumes the coroutine. Launchers take the
+// tracer of the executor's context, so a tracer per context gives
+// per-executor figures.
+class io_tracer
+{
+public:
+    virtual ~io_tracer() = default;
+    virtual void on_event(trace_event const& e) noexcept = 0;
+};
+
+// HdrHistogram-style log-linear histogram of nanosecond values.
+// Each power of two is split into 32 linear sub-buckets, about 3%
+// relative error at any magnitude. Recording is a relaxed atomic
+// increment, safe from any thread.
+class latency_histogram
+{
+    static constexpr unsigned sub_bits = 5;
+    static constexpr unsigned sub_count = 1u << sub_bits;
+    static constexpr unsigned size = (64 - sub_bits + 1) * sub_count;
+
+    std::atomic<std::uint64_t> counts_[size] = {};
+    std::atomic<std::uint64_t> total_{0};
+    std::atomic<std::uint64_t> max_{0};
+
+    static unsigned
+    index(std::uint64_t v) noexcept
+    {
+        if(v < sub_count)
+            return static_cast<unsigned>(v);
+        unsigned msb = std::bit_width(v) - 1;
+        unsigned sub = static_cast<unsigned>(v >> (msb - sub_bits)) & (sub_count - 1);
+        return (msb - sub_bits + 1) * sub_count + sub;
+    }
+
+    // Smallest value counted in bucket i
+    static std::uint64_t
+    lowest(unsigned i) noexcept
+    {
+        if(i < sub_count)
+            return i;
+        unsigned b = i / sub_count;
+        return std::uint64_t(sub_count + i % sub_count) << (b - 1);
+    }
+
+public:
+    void
+    record(std::uint64_t ns) noexcept
+    {
+        counts_[index(ns)].fetch_add(1, std::memory_order_relaxed);
+        total_.fetch_add(1, std::memory_order_relaxed);
+        auto m = max_.load(std::memory_order_relaxed);
+        while(ns > m && !max_.compare_exchange_weak(m, ns, std::memory_order_relaxed))
+            ;
+    }
+
+    std::uint64_t count() const noexcept { return total_.load(std::memory_order_relaxed); }
+    std::uint64_t max() const noexcept { return max_.load(std::memory_order_relaxed); }
+
+    // Highest value equivalent to the recorded value at or below
+    // which fraction q of the samples fall
+    std::uint64_t
+    percentile(double q) const noexcept
+    {
+        auto n = count();
+        if(n == 0)
+            return 0;
+        auto want = static_cast<std::uint64_t>(q * static_cast<double>(n));
+        if(want == 0)
+            want = 1;
+        std::uint64_t seen = 0;
+        for(unsigned i = 0; i < size; ++i)
+        {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if(seen >= want)
+                return std::min(lowest(i + 1) - 1, max());
+        }
+        return max();
+    }
+
+    void
+    print(char const* name, std::FILE* f = stdout) const
+    {
+        std::fprintf(f, "%-10s %10llu samples  p50 %8llu  p90 %8llu  "
+            "p99 %8llu  p99.9 %8llu  max %8llu ns\n", name,
+            static_cast<unsigned long long>(count()),
+            static_cast<unsigned long long>(percentile(0.5)),
+            static_cast<unsigned long long>(percentile(0.9)),
+            static_cast<unsigned long long>(percentile(0.99)),
+            static_cast<unsigned long long>(percentile(0.999)),
+            static_cast<unsigned long long>(max()));
+    }
+};
+
+// An io_tracer keeping one histogram per event kind
+class histogram_tracer : public io_tracer
+{
+public:
+    latency_histogram await;
+    latency_histogram schedule;
+    latency_histogram task;
+
+    void
+    on_event(trace_event const& e) noexcept override
+    {
+        auto ns = static_cast<std::uint64_t>(std::max<std::int64_t>(e.duration.count(), 0));
+        switch(e.kind)
+        {
+        case trace_kind::await: await.record(ns); break;
+        case trace_kind::schedule: schedule.record(ns); break;
+        case trace_kind::task: task.record(ns); break;
+        }
+    }
+
+    void
+    print(std::FILE* f = stdout) const
+    {
+        await.print("await", f);
+        schedule.print("schedule", f);
+        task.print("task", f);
+    }
+};
+
+#endif // CAPY_TRACING
+
+// ============================================================
+// this_coro tags
+// ============================================================
+
+namespace this_coro {
+
+struct environment_tag {};
+struct executor_tag {};
+struct stop_token_tag {};
+struct allocator_tag {};
+
+inline constexpr environment_tag environment{};
+inline constexpr executor_tag executor{};
+inline constexpr stop_token_tag stop_token{};
+inline constexpr allocator_tag allocator{};
+
+} // namespace this_coro
+
+// ============================================================
+// current_frame_allocator (thread-local)
+// ============================================================
+
+namespace detail {
+
+// The thread's frame allocator, together with a one-entry cache of
+// whether it is a request_arena so frame allocation classifies a
+// resource only when it changes. One thread_local keeps this to a
+// single TLS lookup.
+struct frame_allocator_tls
+{
+    std::pmr::memory_resource* mr = nullptr;
+    std::pmr::memory_resource* classified = nullptr;
+    bool is_arena = false;
+
+    bool
+    current_is_arena() noexcept
+    {
+        if(mr != classified)
+        {
+            classified = mr;
+            is_arena = typeid(*mr) == typeid(request_arena);
+        }
+        return is_arena;
+    }
+};
+
+inline frame_allocator_tls&
+frame_tls() noexcept
+{
+    static thread_local frame_allocator_tls tls;
+    return tls;
+}
+
+} // namespace detail
+
+inline std::pmr::memory_resource*&
+current_frame_allocator() noexcept
+{
+    return detail::frame_tls().mr;
+}
+
+#if CAPY_FRAME_TRACKING
+// Promise type of the frame being allocated or freed, set around the
+// memory resource call and null otherwise
+inline std::type_info const*&
+current_frame_type() noexcept
+{
+    static thread_local std::type_info const* type = nullptr;
+    return type;
+}
+#endif
+
+// ============================================================
+// IoAwaitable concept
+// ============================================================
+
+template<typename A>
+concept IoAwaitable =
+    requires(
+        A a,
+        std::coroutine_handle<> h,
+        io_env const* env)
+    {
+        a.await_suspend(h, env);
+    };
+
+namespace detail {
+
+// Awaitables that resume their awaiter by symmetric transfer from a
+// frame running in the same environment declare
+//
+//     static constexpr bool resumes_in_environment = true;
+//
+// The resuming frame has already installed the environment's frame
+// allocator on the current thread, so the awaiter need not.
+template<class A>
+concept resumes_in_environment =
+    requires { requires A::resumes_in_environment; };
+
+} // namespace detail
+
+// ============================================================
+// IoRunnable concept
+// ============================================================
+
+template<typename T>
+concept IoRunnable =
+    IoAwaitable<T> &&
+    requires { typename T::promise_type; } &&
+    requires(T& t, T const& ct, typename T::promise_type const& cp)
+    {
+        { ct.handle() } noexcept
+            -> std::same_as<std::coroutine_handle<typename T::promise_type>>;
+        { cp.exception() } noexcept -> std::same_as<std::exception_ptr>;
+        { t.release() } noexcept;
+    } &&
+    (std::is_void_v<decltype(std::declval<T&>().await_resume())> ||
+     requires(typename T::promise_type& p) {
+         p.result();
+     });
+
+// ============================================================
+// StaticFrameAllocator concept
+// ============================================================
+
+// A frame allocator whose type is fixed at compile time. Frames
+// allocated through it carry no trailing memory_resource pointer
+// and are freed with a direct, inlinable call. The returned
+// storage must be aligned to alignof(std::max_align_t).
+template<class A>
+concept StaticFrameAllocator =
+    requires(void* p, std::size_t n)
+    {
+        { A::allocate(n) } -> std::same_as<void*>;
+        { A::deallocate(p, n) } noexcept;
+    };
+
+// Frames drawn directly from recycling_frame_pool
+struct recycled_frames
+{
+    static void*
+    allocate(std::size_t n)
+    {
+        return recycling_frame_pool::allocate_frame(n);
+    }
+
+    static void
+    deallocate(void* p, std::size_t n) noexcept
+    {
+        recycling_frame_pool::deallocate_frame(p, n);
+    }
+};
+
+static_assert(StaticFrameAllocator<recycled_frames>);
+
+#if CAPY_FRAME_SIZE_REGISTRY
+// ============================================================
+// frame_size_registry - frame sizes seen per promise type
+// ============================================================
+
+// Frame sizes are chosen by the compiler and are not available as
+// constants, so they are learned at run time. The first allocation
+// of each distinct size for a promise type is recorded here and
+// reported to the observer, if one is set. Sizes are those the
+// memory resource sees, including the trailing resource pointer.
+// A warm-up run, or sizes saved by a previous process, can then be
+// handed to recycling_frame_pool::reserve at startup so the first
+// burst of traffic finds its blocks already carved.
+class frame_size_registry
+{
+public:
+    struct entry
+    {
+        std::type_info const* type;
+        std::size_t size;
+    };
+
+    using observer = void (*)(std::type_info const& type, std::size_t size) noexcept;
+
+private:
+    mutable std::mutex mtx_;
+    std::vector<entry> entries_;
+    std::atomic<observer> observer_{nullptr};
+
+public:
+    static frame_size_registry&
+    get() noexcept
+    {
+        static frame_size_registry r;
+        return r;
+    }
+
+    void
+    set_observer(observer f) noexcept
+    {
+        observer_.store(f, std::memory_order_release);
+    }
+
+    void
+    add(std::type_info const& type, std::size_t size)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            entries_.push_back({&type, size});
+        }
+        if(auto f = observer_.load(std::memory_order_acquire))
+            f(type, size);
+    }
+
+    std::vector<entry>
+    entries() const
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return entries_;
+    }
+
+    // Reserve count blocks for every recorded size
+    void
+    prewarm(std::size_t count) const
+    {
+        for(auto const& e : entries())
+            recycling_frame_pool::reserve(e.size, count);
+    }
+
+    void
+    print(std::FILE* f = stdout) const
+    {
+        for(auto const& e : entries())
+            std::fprintf(f, "  %8zu bytes  %s\n", e.size, e.type->name());
+    }
+};
+
+namespace detail {
+
+// Distinct sizes already recorded for Promise. Once every slot is
+// taken, further sizes of that type go unrecorded. The common case
+// is one or two relaxed loads of words that are only ever written
+// once.
+template<class Promise>
+struct frame_size_note
+{
+    static constexpr std::size_t slots = 8;
+    static inline std::atomic<std::size_t> seen[slots] = {};
+
+    static void
+    record(std::size_t n)
+    {
+        for(auto& s : seen)
+        {
+            std::size_t v = s.load(std::memory_order_relaxed);
+            if(v == 0 && s.compare_exchange_strong(v, n, std::memory_order_relaxed))
+                return frame_size_registry::get().add(typeid(Promise), n);
+            if(v == n)
+                return;
+        }
+    }
+};
+
+} // namespace detail
+
+#endif
+
+// ============================================================
+// io_awaitable_support CRTP mixin
+// ============================================================
+
+// FrameAllocator is void to use the thread-local frame allocator,
+// or a StaticFrameAllocator to bypass it entirely.
+template<typename Derived, typename FrameAllocator = void>
+class io_awaitable_support
+{
+    io_env const* env_ = nullptr;
+    mutable std::coroutine_handle<> cont_{std::noop_coroutine()};
+
+    static constexpr std::size_t ptr_alignment = alignof(void*);
+
+    static std::size_t
+    aligned_offset(std::size_t n) noexcept
+    {
+        return (n + ptr_alignment - 1) & ~(ptr_alignment - 1);
+    }
+
+public:
+    static void*
+    operator new(std::size_t size)
+    {
+        if constexpr (!std::is_void_v<FrameAllocator>)
+        {
+#if CAPY_FRAME_SIZE_REGISTRY
+            detail::frame_size_note<Derived>::record(size);
+#endif
+            return FrameAllocator::allocate(size);
+        }
+
+        auto& tls = detail::frame_tls();
+        auto* mr = tls.mr;
+        bool arena = false;
+        if(!mr)
+            mr = std::pmr::get_default_resource();
+        else
+            arena = tls.current_is_arena();
+
+        std::size_t ptr_offset = aligned_offset(size);
+        std::size_t total = ptr_offset + sizeof(std::pmr::memory_resource*);
+#if CAPY_FRAME_SIZE_REGISTRY
+        detail::frame_size_note<Derived>::record(total);
+#endif
+#if CAPY_FRAME_TRACKING
+        current_frame_type() = &typeid(Derived);
+        void* raw;
+        try
+        {
+            raw = mr->allocate(total, alignof(std::max_align_t));
+        }
+        catch(...)
+        {
+            current_frame_type() = nullptr;
+            throw;
+        }
+        current_frame_type() = nullptr;
+#else
+        void* raw = mr->allocate(total, alignof(std::max_align_t));
+#endif
+
+        // The low bit marks arena frames, whose deallocation is a no-op
+        auto* ptr_loc = reinterpret_cast<std::uintptr_t*>(
+            static_cast<char*>(raw) + ptr_offset);
+        *ptr_loc = reinterpret_cast<std::uintptr_t>(mr) | arena;
+
+        return raw;
+    }
+
+    static void
+    operator delete(void* ptr, std::size_t size)
+    {
+        if constexpr (!std::is_void_v<FrameAllocator>)
+            return FrameAllocator::deallocate(ptr, size);
+
+        std::size_t ptr_offset = aligned_offset(size);
+        auto bits = *reinterpret_cast<std::uintptr_t const*>(
+            static_cast<char*>(ptr) + ptr_offset);
+        if(bits & 1)
+            return;
+        auto* mr = reinterpret_cast<std::pmr::memory_resource*>(bits);
+
+        std::size_t total = ptr_offset + sizeof(std::pmr::memory_resource*);
+#if CAPY_FRAME_TRACKING
+        current_frame_type() = &typeid(Derived);
+        mr->deallocate(ptr, total, alignof(std::max_align_t));
+        current_frame_type() = nullptr;
+#else
+        mr->deallocate(ptr, total, alignof(std::max_align_t));
+#endif
+    }
+
+    // The continuation is not owned: an awaiting coroutine owns the
+    // task it awaits, so destroying cont_ here would destroy the
+    // parent twice, and detached frames have no continuation at all
+    ~io_awaitable_support() = default;
+
+    void set_continuation(std::coroutine_handle<> cont) noexcept
+    {
+        cont_ = cont;
+    }
+
+    std::coroutine_handle<> continuation() const noexcept
+    {
+        return std::exchange(cont_, std::noop_coroutine());
+    }
+
+    void set_environment(io_env const* env) noexcept
+    {
+        env_ = env;
+    }
+
+    io_env const* environment() const noexcept
+    {
+        return env_;
+    }
+
+    template<typename A>
+    decltype(auto) transform_awaitable(A&& a)
+    {
+        return std::forward<A>(a);
+    }
+
+    template<typename T>
+    auto await_transform(T&& t)
+    {
+        using Tag = std::decay_t<T>;
+
+        if constexpr (std::is_same_v<Tag, this_coro::environment_tag>)
+        {
+            struct awaiter
+            {
+                io_env const* env_;
+                bool await_ready() const noexcept { return true; }
+                void await_suspend(std::coroutine_handle<>) const noexcept {}
+                io_env const* await_resume() const noexcept { return env_; }
+            };
+            return awaiter{env_};
+        }
+        else if constexpr (std::is_same_v<Tag, this_coro::executor_tag>)
+        {
+            struct awaiter
+            {
+                executor_ref executor_;
+                bool await_ready() const noexcept { return true; }
+                void await_suspend(std::coroutine_handle<>) const noexcept {}
+                executor_ref await_resume() const noexcept { return executor_; }
+            };
+            return awaiter{env_->executor};
+        }
+        else if constexpr (std::is_same_v<Tag, this_coro::stop_token_tag>)
+        {
+            struct awaiter
+            {
+                inplace_stop_token token_;
+                bool await_ready() const noexcept { return true; }
+                void await_suspend(std::coroutine_handle<>) const noexcept {}
+                inplace_stop_token await_resume() const noexcept { return token_; }
+            };
+            return awaiter{env_->stop_token};
+        }
+        else if constexpr (std::is_same_v<Tag, this_coro::allocator_tag>)
+        {
+            struct awaiter
+            {
+                std::pmr::memory_resource* allocator_;
+                bool await_ready() const noexcept { return true; }
+                void await_suspend(std::coroutine_handle<>) const noexcept {}
+                std::pmr::memory_resource* await_resume() const noexcept { return allocator_; }
+            };
+            return awaiter{env_->allocator};
+        }
+        else
+        {
+            return static_cast<Derived*>(this)->transform_awaitable(
+                std::forward<T>(t));
+        }
+    }
+};
+
+// ============================================================
+// frame_stats_resource - frame allocation statistics
+// ============================================================
+
+// Forwards to an upstream resource while counting allocations, live
+// and peak live blocks, and requests per (promise type, size) pair,
+// from which the size histogram follows. The promise type is only
+// known with CAPY_FRAME_TRACKING; otherwise it is null. Frames of a
+// StaticFrameAllocator task bypass memory resources and are not seen.
+// Install as a context's frame allocator or as io_env::allocator to
+// size pools from the real frame distribution.
+class frame_stats_resource : public std::pmr::memory_resource
+{
+public:
+    struct entry
+    {
+        std::type_info const* type;
+        std::size_t size;
+        std::size_t allocs = 0;
+        std::size_t frees = 0;
+    };
+
+    struct totals
+    {
+        std::size_t allocs = 0;
+        std::size_t frees = 0;
+        std::size_t live = 0;
+        std::size_t peak_live = 0;
+        std::size_t live_bytes = 0;
+        std::size_t peak_live_bytes = 0;
+    };
+
+private:
+    std::pmr::memory_resource* upstream_;
+    mutable std::mutex mtx_;
+    std::vector<entry> entries_;    // few distinct pairs; searched linearly
+    totals totals_;
+
+    static std::type_info const*
+    tag() noexcept
+    {
+#if CAPY_FRAME_TRACKING
+        return current_frame_type();
+#else
+        return nullptr;
+#endif
+    }
+
+    entry&
+    entry_locked(std::type_info const* type, std::size_t n)
+    {
+        for(auto& e : entries_)
+            if(e.size == n && e.type == type)
+                return e;
+        return entries_.emplace_back(entry{type, n});
+    }
+
+    void*
+    do_allocate(std::size_t n, std::size_t align) override
+    {
+        void* p = upstream_->allocate(n, align);
+        std::lock_guard<std::mutex> lock(mtx_);
+        ++entry_locked(tag(), n).allocs;
+        ++totals_.allocs;
+        totals_.peak_live = std::max(totals_.peak_live, ++totals_.live);
+        totals_.live_bytes += n;
+        totals_.peak_live_bytes = std::max(totals_.peak_live_bytes,
+            totals_.live_bytes);
+        return p;
+    }
+
+    void
+    do_deallocate(void* p, std::size_t n, std::size_t align) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            ++entry_locked(tag(), n).frees;
+            ++totals_.frees;
+            --totals_.live;
+            totals_.live_bytes -= n;
+        }
+        upstream_->deallocate(p, n, align);
+    }
+
+    bool
+    do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+public:
+    explicit
+    frame_stats_resource(
+        std::pmr::memory_resource* upstream = get_recycling_frame_pool()) noexcept
+        : upstream_(upstream)
+    {
+    }
+
+    std::pmr::memory_resource* upstream() const noexcept { return upstream_; }
+
+    totals
+    get_totals() const
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return totals_;
+    }
+
+    std::vector<entry>
+    entries() const
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return entries_;
+    }
+
+    // Allocation count per block size, in increasing size order
+    std::vector<std::pair<std::size_t, std::size_t>>
+    size_histogram() const
+    {
+        std::vector<std::pair<std::size_t, std::size_t>> h;
+        for(auto const& e : entries())
+            h.emplace_back(e.size, e.allocs);
+        std::sort(h.begin(), h.end());
+        std::size_t out = 0;
+        for(std::size_t i = 0; i < h.size(); ++i)
+        {
+            if(out > 0 && h[out - 1].first == h[i].first)
+                h[out - 1].second += h[i].second;
+            else
+                h[out++] = h[i];
+        }
+        h.resize(out);
+        return h;
+    }
+
+    void
+    print(std::FILE* f = stdout) const
+    {
+        auto t = get_totals();
+        std::fprintf(f, "frames: %zu allocs, %zu frees, %zu live, "
+            "%zu peak live (%zu bytes)\n", t.allocs, t.frees, t.live,
+            t.peak_live, t.peak_live_bytes);
+        for(auto const& e : entries())
+            std::fprintf(f, "  %8zu bytes %10zu allocs %10zu frees  %s\n",
+                e.size, e.allocs, e.frees, e.type ? e.type->name() : "?");
+    }
+};
+
+// ============================================================
+// task<T> — lazy coroutine task satisfying IoRunnable
+// ============================================================
+
+namespace detail {
+
+// Receives a task's completion in place of a continuation. Used by
+// combinators that drive a task without an awaiting coroutine. The
+// returned handle is resumed by symmetric transfer.
+struct task_completion
+{
+    std::coroutine_handle<> (*complete)(task_completion*) noexcept;
+};
+
+template<typename T>
+struct task_return_base
+{
+    std::optional<T> result_;
+
+    // Constructs the result in place from the co_return operand
+    template<class U = T>
+        requires std::constructible_from<T, U&&>
+    void return_value(U&& value)
+    {
+        result_.emplace(std::forward<U>(value));
+    }
+
+    T&& result() noexcept { return std::move(*result_); }
+};
+
+template<>
+struct task_return_base<void>
+{
+    void return_void() {}
+};
+
+// Make the environment's allocator the thread's frame allocator.
+// Each call touches thread-local storage, which costs a
+// __tls_get_addr call in position-independent code.
+inline void
+restore_frame_allocator(io_env const* env) noexcept
+{
+    auto* fa = env->allocator;
+    if(fa && fa != current_frame_allocator())
+        current_frame_allocator() = fa;
+}
+
+// Wraps each IoAwaitable awaited from a task or generator body and
+// passes it the frame's environment. The frame allocator is
+// restored only after a suspension that may have resumed this
+// coroutine on another thread, or after one thread ran frames from
+// other environments. An lvalue awaitable is held by reference.
+template<class Awaitable, class Promise>
+struct io_transform_awaiter
+{
+    using A = std::decay_t<Awaitable>;
+
+    Awaitable a_;
+    Promise* p_;
+    bool suspended_ = false;
+#if CAPY_TRACING
+    trace_clock::time_point suspended_at_{};
+#endif
+
+    // Awaitables that can finish inside await_ready given the
+    // environment, such as leaf_task, are offered it
+    bool
+    await_ready() noexcept
+    {
+        if constexpr (requires(A& a, io_env const* env) { a.await_ready(env); })
+            return a_.await_ready(p_->environment());
+        else
+            return a_.await_ready();
+    }
+
+    decltype(auto) await_resume()
+    {
+        if constexpr (!resumes_in_environment<A>)
+        {
+            if(suspended_)
+                restore_frame_allocator(p_->environment());
+        }
+#if CAPY_TRACING
+        if(suspended_)
+            trace_resume();
+#endif
+        return a_.await_resume();
+    }
+
+    template<class P>
+    auto await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+        suspended_ = true;
+        if constexpr (requires { p_->on_suspend(); })
+            p_->on_suspend();
+#if CAPY_TRACING
+        if(p_->environment()->tracer)
+            suspended_at_ = trace_clock::now();
+#endif
+        return a_.await_suspend(h, p_->environment());
+    }
+
+#if CAPY_TRACING
+    // Awaitables that post their completion may report when they
+    // did through trace_ready_time(), splitting the wait into time
+    // in the operation and time in the run queue
+    void
+    trace_resume() noexcept
+    {
+        auto const* env = p_->environment();
+        auto* tr = env->tracer;
+        if(!tr)
+            return;
+        auto now = trace_clock::now();
+        auto* ctx = &env->executor.context();
+        auto ready = now;
+        if constexpr (requires(A& a) { a.trace_ready_time(); })
+        {
+            auto r = a_.trace_ready_time();
+            if(r != trace_clock::time_point{})
+            {
+                ready = r;
+                tr->on_event({trace_kind::schedule, &typeid(A), ctx, now - r});
+            }
+        }
+        tr->on_event({trace_kind::await, &typeid(A), ctx, ready - suspended_at_});
+    }
+#endif
+};
+
+} // namespace detail
+
+template<typename T = void, typename FrameAllocator = void>
+struct [[nodiscard]] task
+{
+    static_assert(std::is_void_v<FrameAllocator> ||
+        StaticFrameAllocator<FrameAllocator>);
+
+    using result_type = T;
+
+    struct promise_type
+        : io_awaitable_support<promise_type, FrameAllocator>
+        , detail::task_return_base<T>
+    {
+        std::exception_ptr ep_;
+        detail::task_completion* completion_ = nullptr;
+        bool started_inline_ = false;
+        bool detached_ = false;
+#if CAPY_TRACING
+        trace_clock::time_point started_at_{};
+#endif
+
+        std::exception_ptr exception() const noexcept { return ep_; }
+
+        void set_completion(detail::task_completion* c) noexcept
+        {
+            completion_ = c;
+        }
+
+        // Nobody awaits a detached task: the frame destroys itself at
+        // final suspend and the context handles its exception
+        void set_detached() noexcept
+        {
+            detached_ = true;
+        }
+
+        std::coroutine_handle<> finish_detached() noexcept
+        {
+            executor_ref ex = this->environment()->executor;
+            if(ep_)
+                ex.context().handle_exception(std::move(ep_));
+            std::coroutine_handle<promise_type>::from_promise(*this).destroy();
+            ex.on_work_finished();
+            return std::noop_coroutine();
+        }
+
+        task get_return_object()
+        {
+            return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        auto initial_suspend() noexcept
+        {
+            struct awaiter
+            {
+                promise_type* p_;
+
+                bool await_ready() const noexcept { return false; }
+
+                void await_suspend(std::coroutine_handle<>) const noexcept
+                {
+                }
+
+                // A task started by its awaiting parent runs on the
+                // parent's thread, in the parent's environment
+                void await_resume() const noexcept
+                {
+                    if(!p_->started_inline_)
+                        detail::restore_frame_allocator(p_->environment());
+#if CAPY_TRACING
+                    if(p_->environment()->tracer)
+                        p_->started_at_ = trace_clock::now();
+#endif
+                }
+            };
+            return awaiter{this};
+        }
+
+        auto final_suspend() noexcept
+        {
+            struct awaiter
+            {
+                promise_type* p_;
+
+                bool await_ready() const noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<>) const noexcept
+                {
+#if CAPY_TRACING
+                    auto const* env = p_->environment();
+                    if(auto* tr = env->tracer)
+                        tr->on_event({trace_kind::task, &typeid(promise_type),
+                            &env->executor.context(),
+                            trace_clock::now() - p_->started_at_});
+#endif
+                    if(p_->completion_)
+                        return p_->completion_->complete(p_->completion_);
+                    if(p_->detached_)
+                        return p_->finish_detached();
+                    return p_->continuation();
+                }
+
+                void await_resume() const noexcept {}
+            };
+            return awaiter{this};
+        }
+
+        void unhandled_exception()
+        {
+            ep_ = std::current_exception();
+        }
+
+        template<class Awaitable>
+        auto transform_awaitable(Awaitable&& a)
+        {
+            using A = std::decay_t<Awaitable>;
+            if constexpr (IoAwaitable<A>)
+            {
+                return detail::io_transform_awaiter<Awaitable, promise_type>{
+                    std::forward<Awaitable>(a), this};
+            }
+            else
+            {
+                static_assert(sizeof(A) == 0, "requires IoAwaitable");
+            }
+        }
+    };
+
+    std::coroutine_handle<promise_type> h_;
+
+    ~task()
+    {
+        if(h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    auto await_resume()
+    {
+        if(h_.promise().ep_)
+            std::rethrow_exception(h_.promise().ep_);
+        if constexpr (! std::is_void_v<T>)
+            return h_.promise().result();
+        else
+            return;
+    }
+
+    static constexpr bool resumes_in_environment = true;
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont, io_env const* env)
+    {
+        h_.promise().set_continuation(cont);
+        h_.promise().set_environment(env);
+        h_.promise().started_inline_ = true;
+        return h_;
+    }
+
+    std::coroutine_handle<promise_type> handle() const noexcept { return h_; }
+
+    void release() noexcept { h_ = nullptr; }
+
+    task(task const&) = delete;
+    task& operator=(task const&) = delete;
+
+    task(task&& other) noexcept
+        : h_(std::exchange(other.h_, nullptr))
+    {
+    }
+
+    task& operator=(task&& other) noexcept
+    {
+        if(this != &other)
+        {
+            if(h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h)
+        : h_(h)
+    {
+    }
+};
+
+// ============================================================
+// Concept satisfaction checks
+// ============================================================
+
+static_assert(IoAwaitable<task<int>>);
+static_assert(IoRunnable<task<int>>);
+static_assert(IoAwaitable<task<>>);
+static_assert(IoRunnable<task<>>);
+static_assert(IoRunnable<task<int, recycled_frames>>);
+
+// ============================================================
+// leaf_task<T> - child task with a short completion path
+// ============================================================
+
+// For helpers that almost always finish without suspending. The
+// awaiting expression starts the child from await_ready, on the
+// parent's thread and in the parent's environment. If the child
+// finishes there the parent never suspends: no continuation is
+// stored and nothing is resumed by transfer. A child that does
+// suspend hands over through one atomic exchange, since it may
+// finish on another thread before the parent has suspended. The
+// frame is still allocated, from the frame allocator like a task's.
+// A leaf_task runs under run_sync but not under when_all, when_any
+// or spawn.
+template<typename T = void, typename FrameAllocator = void>
+struct [[nodiscard]] leaf_task
+{
+    static_assert(std::is_void_v<FrameAllocator> ||
+        StaticFrameAllocator<FrameAllocator>);
+
+    using result_type = T;
+
+    struct promise_type
+        : io_awaitable_support<promise_type, FrameAllocator>
+        , detail::task_return_base<T>
+    {
+        // Whichever of the child finishing and the parent suspending
+        // comes second resumes the parent. Until the child first
+        // suspends it runs nested in the parent's await_ready, on
+        // the parent's thread, and finishing is a plain store.
+        static constexpr std::uint8_t running = 0;
+        static constexpr std::uint8_t waiting = 1;
+        static constexpr std::uint8_t done = 2;
+        static constexpr std::uint8_t nested = 3;
+
+        std::exception_ptr ep_;
+        std::atomic<std::uint8_t> state_{running};
+        bool started_inline_ = false;
+
+        std::exception_ptr exception() const noexcept { return ep_; }
+
+        leaf_task get_return_object()
+        {
+            return leaf_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        auto initial_suspend() noexcept
+        {
+            struct awaiter
+            {
+                promise_type* p_;
+
+                bool await_ready() const noexcept { return false; }
                 void await_suspend(std::coroutine_handle<>) const noexcept {}
-                executor_ref await_resume() const noexcept { return executor_; }
+
+                void await_resume() const noexcept
+                {
+                    if(!p_->started_inline_)
+                        detail::restore_frame_allocator(p_->environment());
+                }
             };
-            return awaiter{env_->executor};
+            return awaiter{this};
+        }
+
+        auto final_suspend() noexcept
+        {
+            struct awaiter
+            {
+                promise_type* p_;
+
+                bool await_ready() const noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<>) const noexcept
+                {
+                    if(p_->state_.load(std::memory_order_relaxed) == nested)
+                    {
+                        p_->state_.store(done, std::memory_order_relaxed);
+                        return std::noop_coroutine();
+                    }
+                    if(p_->state_.exchange(done, std::memory_order_acq_rel) == waiting)
+                        return p_->continuation();
+                    return std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept {}
+            };
+            return awaiter{this};
+        }
+
+        void
+        unhandled_exception()
+        {
+            ep_ = std::current_exception();
+        }
+
+        // Called by the awaiter of each co_await in the body before
+        // it suspends. From then on the child may finish on another
+        // thread, so finishing takes the atomic path.
+        void
+        on_suspend() noexcept
+        {
+            if(state_.load(std::memory_order_relaxed) == nested)
+                state_.store(running, std::memory_order_relaxed);
+        }
+
+        template<class Awaitable>
+        auto transform_awaitable(Awaitable&& a)
+        {
+            using A = std::decay_t<Awaitable>;
+            if constexpr (IoAwaitable<A>)
+            {
+                return detail::io_transform_awaiter<Awaitable, promise_type>{
+                    std::forward<Awaitable>(a), this};
+            }
+            else
+            {
+                static_assert(sizeof(A) == 0, "requires IoAwaitable");
+            }
+        }
+    };
+
+    std::coroutine_handle<promise_type> h_;
+    bool started_ = false;
+
+    ~leaf_task()
+    {
+        if(h_)
+            h_.destroy();
+    }
+
+    // Resumes its awaiter from a frame in the same environment
+    static constexpr bool resumes_in_environment = true;
+
+    bool await_ready() const noexcept { return false; }
+
+    // Called in place of await_ready() by the awaiting frame's
+    // await_transform, which has the environment at hand
+    bool
+    await_ready(io_env const* env) noexcept
+    {
+        auto& p = h_.promise();
+        p.set_environment(env);
+        p.started_inline_ = true;
+        p.state_.store(promise_type::nested, std::memory_order_relaxed);
+        started_ = true;
+        h_.resume();
+        return p.state_.load(std::memory_order_acquire) == promise_type::done;
+    }
+
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> cont, io_env const* env) noexcept
+    {
+        auto& p = h_.promise();
+        p.set_continuation(cont);
+        if(!started_)
+        {
+            p.set_environment(env);
+            p.started_inline_ = true;
+            p.state_.store(promise_type::waiting, std::memory_order_relaxed);
+            return h_;
+        }
+        if(p.state_.exchange(promise_type::waiting, std::memory_order_acq_rel) == promise_type::done)
+            return cont;
+        return std::noop_coroutine();
+    }
+
+    auto await_resume()
+    {
+        if(h_.promise().ep_)
+            std::rethrow_exception(h_.promise().ep_);
+        if constexpr (!std::is_void_v<T>)
+            return h_.promise().result();
+    }
+
+    std::coroutine_handle<promise_type> handle() const noexcept { return h_; }
+
+    void release() noexcept { h_ = nullptr; }
+
+    leaf_task(leaf_task const&) = delete;
+    leaf_task& operator=(leaf_task const&) = delete;
+
+    leaf_task(leaf_task&& other) noexcept
+        : h_(std::exchange(other.h_, nullptr))
+        , started_(other.started_)
+    {
+    }
+
+private:
+    explicit leaf_task(std::coroutine_handle<promise_type> h)
+        : h_(h)
+    {
+    }
+};
+
+static_assert(IoAwaitable<leaf_task<int>>);
+static_assert(IoRunnable<leaf_task<int>>);
+static_assert(IoRunnable<leaf_task<>>);
+
+// ============================================================
+// async_generator<T> - lazy stream of values
+// ============================================================
+
+// A coroutine that co_yields a sequence of T. Awaiting the generator
+// runs its body up to the next co_yield, on the awaiting coroutine's
+// thread and in its environment, and yields a pointer to the yielded
+// object, or nullptr once the body has returned. Nothing is copied:
+// the pointer stays valid until the generator is awaited again or
+// destroyed. One frame, allocated when the generator is created,
+// serves the whole stream.
+//
+//     while(auto* rec = co_await records)
+//         consume(*rec);
+template<typename T, typename FrameAllocator = void>
+struct [[nodiscard]] async_generator
+{
+    static_assert(!std::is_reference_v<T>);
+    static_assert(std::is_void_v<FrameAllocator> ||
+        StaticFrameAllocator<FrameAllocator>);
+
+    using value_type = T;
+
+    struct promise_type
+        : io_awaitable_support<promise_type, FrameAllocator>
+    {
+        T* value_ = nullptr;
+        std::exception_ptr ep_;
+
+        // Returns to the awaiting coroutine by symmetric transfer
+        struct yield_awaiter
+        {
+            promise_type* p_;
+
+            bool await_ready() const noexcept { return false; }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<>) const noexcept
+            {
+                return p_->continuation();
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        async_generator get_return_object()
+        {
+            return async_generator{
+                std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        // Always resumed inline by the awaiting coroutine, whose
+        // frame allocator is already current
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        yield_awaiter final_suspend() noexcept
+        {
+            value_ = nullptr;
+            return {this};
+        }
+
+        // A yielded temporary lives until the body is resumed
+        yield_awaiter yield_value(T& v) noexcept
+        {
+            value_ = std::addressof(v);
+            return {this};
+        }
+
+        yield_awaiter yield_value(T&& v) noexcept
+        {
+            value_ = std::addressof(v);
+            return {this};
+        }
+
+        void return_void() noexcept {}
+
+        void unhandled_exception()
+        {
+            ep_ = std::current_exception();
+        }
+
+        template<class Awaitable>
+        auto transform_awaitable(Awaitable&& a)
+        {
+            using A = std::decay_t<Awaitable>;
+            if constexpr (IoAwaitable<A>)
+            {
+                return detail::io_transform_awaiter<Awaitable, promise_type>{
+                    std::forward<Awaitable>(a), this};
+            }
+            else
+            {
+                static_assert(sizeof(A) == 0, "requires IoAwaitable");
+            }
+        }
+    };
+
+    std::coroutine_handle<promise_type> h_;
+
+    ~async_generator()
+    {
+        if(h_)
+            h_.destroy();
+    }
+
+    static constexpr bool resumes_in_environment = true;
+
+    bool await_ready() const noexcept { return h_.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont, io_env const* env) noexcept
+    {
+        h_.promise().set_continuation(cont);
+        h_.promise().set_environment(env);
+        return h_;
+    }
+
+    // The exception escaping the body, if any, is rethrown once;
+    // the generator is finished afterwards
+    T* await_resume()
+    {
+        auto& p = h_.promise();
+        if(p.ep_)
+            std::rethrow_exception(std::exchange(p.ep_, nullptr));
+        return p.value_;
+    }
+
+    std::coroutine_handle<promise_type> handle() const noexcept { return h_; }
+
+    async_generator(async_generator const&) = delete;
+    async_generator& operator=(async_generator const&) = delete;
+
+    async_generator(async_generator&& other) noexcept
+        : h_(std::exchange(other.h_, nullptr))
+    {
+    }
+
+    async_generator& operator=(async_generator&& other) noexcept
+    {
+        if(this != &other)
+        {
+            if(h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+
+private:
+    explicit async_generator(std::coroutine_handle<promise_type> h)
+        : h_(h)
+    {
+    }
+};
+
+static_assert(IoAwaitable<async_generator<int>>);
+static_assert(IoAwaitable<async_generator<int const>>);
+
+// ============================================================
+// when_all / when_any - concurrent composition of tasks
+// ============================================================
+
+namespace detail {
+
+template<class T>
+struct is_task : std::false_type {};
+
+template<class T, class A>
+struct is_task<task<T, A>> : std::true_type {};
+
+template<class T>
+using combinator_result_t =
+    std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+// Shared state for when_all and when_any, held by value inside the
+// awaiter in the parent's frame. Each child task reports to its own
+// completion slot; the last child to finish resumes the parent.
+template<bool Any, class... Tasks>
+class when_awaiter
+{
+    static constexpr std::size_t N = sizeof...(Tasks);
+    static constexpr std::size_t no_winner = std::size_t(-1);
+
+    static_assert(N > 0);
+
+    struct slot : task_completion
+    {
+        when_awaiter* self;
+    };
+
+    std::tuple<Tasks...> tasks_;
+    slot slots_[N];
+    std::atomic<std::size_t> remaining_{0};
+    std::atomic<std::size_t> winner_{no_winner};
+    std::atomic<bool> failed_{false};
+    std::exception_ptr ep_;
+    std::coroutine_handle<> cont_;
+    inplace_stop_source stop_;
+    std::optional<inplace_stop_callback<
+        stop_forwarder<inplace_stop_source>>> parent_stop_;
+    io_env env_;
+
+    template<std::size_t I>
+    auto& promise() noexcept
+    {
+        return std::get<I>(tasks_).handle().promise();
+    }
+
+    template<std::size_t I>
+    static std::coroutine_handle<>
+    complete(task_completion* c) noexcept
+    {
+        auto* self = static_cast<slot*>(c)->self;
+        if constexpr (Any)
+        {
+            std::size_t expected = no_winner;
+            if(self->winner_.compare_exchange_strong(expected, I,
+                    std::memory_order_acq_rel))
+                self->stop_.request_stop();
+        }
+        else
+        {
+            if(self->template promise<I>().exception() &&
+                !self->failed_.exchange(true, std::memory_order_acq_rel))
+            {
+                self->ep_ = self->template promise<I>().exception();
+                self->stop_.request_stop();
+            }
+        }
+        if(self->remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            return self->cont_;
+        return std::noop_coroutine();
+    }
+
+    template<std::size_t I>
+    auto take_result()
+    {
+        using T = typename std::tuple_element_t<I, std::tuple<Tasks...>>::result_type;
+        if constexpr (std::is_void_v<T>)
+            return std::monostate{};
+        else
+            return T(promise<I>().result());
+    }
+
+    template<std::size_t... I>
+    std::coroutine_handle<>
+    start(std::index_sequence<I...>, io_env const* env)
+    {
+        ((slots_[I].complete = &complete<I>, slots_[I].self = this), ...);
+        ((promise<I>().set_environment(&env_),
+          promise<I>().set_completion(&slots_[I])), ...);
+
+        // One extra count keeps the parent from resuming, and the
+        // awaiter from being destroyed, while children are launched.
+        remaining_.store(N + 1, std::memory_order_relaxed);
+        std::coroutine_handle<> handles[] = {std::get<I>(tasks_).handle()...};
+        for(std::size_t i = 0; i + 1 < N; ++i)
+            env->executor.post(handles[i]);
+        remaining_.fetch_sub(1, std::memory_order_acq_rel);
+
+        // The last child cannot have finished, so the awaiter is
+        // still alive; start it by symmetric transfer.
+        return handles[N - 1];
+    }
+
+    template<std::size_t... I>
+    auto results(std::index_sequence<I...>)
+    {
+        if constexpr (Any)
+        {
+            using V = std::variant<combinator_result_t<
+                typename Tasks::result_type>...>;
+            std::optional<V> v;
+            std::size_t w = winner_.load(std::memory_order_acquire);
+            ((w == I ? (rethrow_if<I>(),
+                v.emplace(std::in_place_index<I>, take_result<I>()),
+                void()) : void()), ...);
+            return std::move(*v);
+        }
+        else
+        {
+            if(ep_)
+                std::rethrow_exception(ep_);
+            return std::tuple<combinator_result_t<
+                typename Tasks::result_type>...>{take_result<I>()...};
+        }
+    }
+
+    template<std::size_t I>
+    void rethrow_if()
+    {
+        if(auto ep = promise<I>().exception())
+            std::rethrow_exception(ep);
+    }
+
+public:
+    explicit
+    when_awaiter(Tasks&&... tasks)
+        : tasks_(std::move(tasks)...)
+    {
+    }
+
+    when_awaiter(when_awaiter&& other) noexcept
+        : tasks_(std::move(other.tasks_))
+    {
+    }
+
+    // The last child to finish resumes the awaiter
+    static constexpr bool resumes_in_environment = true;
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> h, io_env const* env)
+    {
+        cont_ = h;
+        env_ = *env;
+        env_.stop_token = stop_.get_token();
+        if(env->stop_token.stop_possible())
+            parent_stop_.emplace(env->stop_token,
+                stop_forwarder<inplace_stop_source>{&stop_});
+        return start(std::index_sequence_for<Tasks...>{}, env);
+    }
+
+    auto await_resume()
+    {
+        parent_stop_.reset();
+        return results(std::index_sequence_for<Tasks...>{});
+    }
+};
+
+} // namespace detail
+
+// Run every task concurrently on the awaiting coroutine's executor.
+// Yields a tuple of results, with std::monostate for void tasks. If
+// any child throws, stop is requested on the rest and the first
+// exception is rethrown once all children have finished.
+template<class... Tasks>
+    requires (detail::is_task<Tasks>::value && ...)
+auto when_all(Tasks... tasks)
+{
+    return detail::when_awaiter<false, Tasks...>(std::move(tasks)...);
+}
+
+// Run every task concurrently and yield the result of the first to
+// finish as a variant whose index identifies the winner. Stop is
+// requested on the losers, and the awaiting coroutine resumes once
+// they have all finished. A child inplace_stop_source linked to the
+// parent's stop token carries the request.
+template<class... Tasks>
+    requires (detail::is_task<Tasks>::value && ...)
+auto when_any(Tasks... tasks)
+{
+    return detail::when_awaiter<true, Tasks...>(std::move(tasks)...);
+}
+
+// ============================================================
+// run_on - await a task on another executor
+// ============================================================
+
+namespace detail {
+
+// Runs a task on ex_ and resumes the awaiting coroutine on its own
+// executor. When the two compare equal the child starts and
+// finishes by symmetric transfer, exactly like a plain co_await.
+// Otherwise each hop goes through dispatch, which only posts when
+// the current thread is not already running the target executor.
+template<class Ex, class Task>
+class run_on_awaiter : task_completion
+{
+    Ex ex_;
+    Task t_;
+    io_env env_;
+    executor_ref parent_ex_;
+    std::coroutine_handle<> cont_;
+    bool same_ = false;
+
+    static std::coroutine_handle<>
+    complete(task_completion* c) noexcept
+    {
+        auto* self = static_cast<run_on_awaiter*>(c);
+        if(self->same_)
+            return self->cont_;
+        // The parent, and with it this awaiter and the executor
+        // parent_ex_ refers to, may be gone once it is dispatched.
+        // The resumed parent finishes the work in await_resume.
+        return self->parent_ex_.dispatch(self->cont_);
+    }
+
+public:
+    run_on_awaiter(Ex const& ex, Task t) noexcept
+        : task_completion{&complete}
+        , ex_(ex)
+        , t_(std::move(t))
+    {
+    }
+
+    // Moved only before the operation starts
+    run_on_awaiter(run_on_awaiter&& other) noexcept
+        : task_completion{&complete}
+        , ex_(std::move(other.ex_))
+        , t_(std::move(other.t_))
+    {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> h, io_env const* env)
+    {
+        cont_ = h;
+        parent_ex_ = env->executor;
+        env_ = *env;
+        env_.executor = executor_ref(ex_);
+        same_ = env_.executor == parent_ex_;
+        auto& p = t_.handle().promise();
+        p.set_environment(&env_);
+        p.set_completion(this);
+        if(same_)
+        {
+            p.started_inline_ = true;
+            return t_.handle();
+        }
+        // Nothing else keeps the parent's context running meanwhile
+        parent_ex_.on_work_started();
+        return env_.executor.dispatch(t_.handle());
+    }
+
+    decltype(auto)
+    await_resume()
+    {
+        if(!same_)
+            parent_ex_.on_work_finished();
+        return t_.await_resume();
+    }
+};
+
+} // namespace detail
+
+// Await t running on ex. The environment is otherwise the awaiting
+// coroutine's, so stop requests and the frame allocator carry over.
+template<Executor Ex, class T, class FrameAllocator>
+auto
+run_on(Ex const& ex, task<T, FrameAllocator> t)
+{
+    return detail::run_on_awaiter<Ex, task<T, FrameAllocator>>(ex, std::move(t));
+}
+
+// ============================================================
+// inline_executor — trivial synchronous executor for demo
+// ============================================================
+
+struct inline_context : execution_context {};
+
+struct inline_executor
+{
+    inline_context* ctx_;
+
+    execution_context& context() const noexcept { return *ctx_; }
+    void on_work_started() const noexcept {}
+    void on_work_finished() const noexcept {}
+
+    std::coroutine_handle<> dispatch(std::coroutine_handle<> h) const
+    {
+        return h;
+    }
+
+    void post(std::coroutine_handle<> h) const
+    {
+        h.resume();
+    }
+
+    bool operator==(inline_executor const& other) const noexcept
+    {
+        return ctx_ == other.ctx_;
+    }
+};
+
+static_assert(Executor<inline_executor>);
+
+// ============================================================
+// thread_pool - multi-threaded work-stealing execution context
+// ============================================================
+
+namespace detail {
+
+// Growable FIFO ring of coroutine handles. Not thread-safe.
+class handle_ring
+{
+    std::vector<void*> buf_;
+    std::size_t head_ = 0;
+    std::size_t size_ = 0;
+
+public:
+    bool empty() const noexcept { return size_ == 0; }
+    std::size_t size() const noexcept { return size_; }
+
+    void
+    push(std::coroutine_handle<> h)
+    {
+        if(size_ == buf_.size())
+        {
+            std::vector<void*> v(buf_.empty() ? 64 : buf_.size() * 2);
+            for(std::size_t i = 0; i < size_; ++i)
+                v[i] = buf_[(head_ + i) % buf_.size()];
+            buf_.swap(v);
+            head_ = 0;
+        }
+        buf_[(head_ + size_) % buf_.size()] = h.address();
+        ++size_;
+    }
+
+    std::coroutine_handle<>
+    pop() noexcept
+    {
+        void* p = buf_[head_];
+        head_ = (head_ + 1) % buf_.size();
+        --size_;
+        return std::coroutine_handle<>::from_address(p);
+    }
+};
+
+// Chase-Lev work-stealing deque with a fixed capacity. The owning
+// worker pushes and pops at the bottom; other workers steal from
+// the top. Algorithm after Le, Pop, Cohen and Zappa Nardelli,
+// "Correct and Efficient Work-Stealing for Weak Memory Models".
+class work_stealing_deque
+{
+    static constexpr std::int64_t capacity = 1024;
+    static constexpr std::int64_t mask = capacity - 1;
+
+    alignas(64) std::atomic<std::int64_t> top_{0};
+    alignas(64) std::atomic<std::int64_t> bottom_{0};
+    std::atomic<void*> buf_[capacity];
+
+public:
+    // Owner only. Returns false when the deque is full.
+    bool
+    push(std::coroutine_handle<> h) noexcept
+    {
+        auto b = bottom_.load(std::memory_order_relaxed);
+        auto t = top_.load(std::memory_order_acquire);
+        if(b - t >= capacity)
+            return false;
+        buf_[b & mask].store(h.address(), std::memory_order_relaxed);
+        bottom_.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Owner only
+    std::coroutine_handle<>
+    pop() noexcept
+    {
+        auto b = bottom_.load(std::memory_order_relaxed) - 1;
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top_.load(std::memory_order_relaxed);
+        if(t > b)
+        {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        void* p = buf_[b & mask].load(std::memory_order_relaxed);
+        if(t == b)
+        {
+            // Last element: race against thieves for it
+            if(!top_.compare_exchange_strong(t, t + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed))
+                p = nullptr;
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+        return std::coroutine_handle<>::from_address(p);
+    }
+
+    // Any thread. May fail spuriously when racing another thief.
+    std::coroutine_handle<>
+    steal() noexcept
+    {
+        auto t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = bottom_.load(std::memory_order_acquire);
+        if(t >= b)
+            return nullptr;
+        void* p = buf_[t & mask].load(std::memory_order_relaxed);
+        if(!top_.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return std::coroutine_handle<>::from_address(p);
+    }
+
+    bool
+    empty() const noexcept
+    {
+        return bottom_.load(std::memory_order_acquire) <=
+            top_.load(std::memory_order_acquire);
+    }
+};
+
+// Pins the calling thread to a set of CPUs and makes the node of
+// the first one the home of the frames it allocates. Both are
+// restored on exit. An empty set, or a set the thread may not use,
+// changes nothing.
+class cpu_binding
+{
+#if CAPY_HAS_NUMA
+    cpu_set_t saved_;
+#endif
+    bool bound_ = false;
+    unsigned saved_node_ = 0;
+
+public:
+    cpu_binding(unsigned const* cpus, std::size_t n) noexcept
+    {
+#if CAPY_HAS_NUMA
+        if(n == 0)
+            return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(std::size_t i = 0; i < n; ++i)
+            if(cpus[i] < CPU_SETSIZE)
+                CPU_SET(cpus[i], &set);
+        if(::pthread_getaffinity_np(::pthread_self(), sizeof(saved_), &saved_) != 0 ||
+            ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) != 0)
+            return;
+        bound_ = true;
+        if(auto* c = frame_pool_cache::get())
+        {
+            saved_node_ = c->node();
+            c->set_node(numa_topology::system().node_of(cpus[0]));
+        }
+#else
+        (void)cpus;
+        (void)n;
+#endif
+    }
+
+    cpu_binding(cpu_binding const&) = delete;
+    cpu_binding& operator=(cpu_binding const&) = delete;
+
+    ~cpu_binding()
+    {
+#if CAPY_HAS_NUMA
+        if(!bound_)
+            return;
+        ::pthread_setaffinity_np(::pthread_self(), sizeof(saved_), &saved_);
+        if(auto* c = frame_pool_cache::get())
+            c->set_node(saved_node_);
+#endif
+    }
+};
+
+// Hint to the CPU that this is a spin-wait loop
+inline void
+cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+} // namespace detail
+
+struct thread_pool_options
+{
+    // Worker count, the thread calling run() included
+    std::size_t threads = std::thread::hardware_concurrency();
+
+    // When not empty, worker i is pinned to cpus[i % cpus.size()] and
+    // allocates frames from that CPU's NUMA node. Use
+    // numa_topology::system().cpus(node) to confine the pool to one
+    // node, or all_cpus() to spread it over every node.
+    std::vector<unsigned> cpus;
+};
+
+class thread_pool : public execution_context
+{
+    // Consecutive LIFO-slot resumes before the slot is bypassed,
+    // so two tasks posting to each other cannot starve the deque.
+    static constexpr unsigned max_lifo_run = 3;
+
+    // Every this many resumes a worker serves the injector and the
+    // oldest entry of its own deque first, so handles buried under
+    // a task that keeps re-posting itself still make progress.
+    static constexpr unsigned fairness_interval = 61;
+
+    // Polls an idle worker makes for new work before it parks
+    static constexpr unsigned spin_rounds = 128;
+
+    struct worker
+    {
+        detail::work_stealing_deque deque;
+        std::coroutine_handle<> lifo;
+        unsigned lifo_run = 0;
+        unsigned tick = 0;
+        std::uint64_t rng = 0;
+        unsigned cpu = 0;
+        unsigned node = 0;
+        bool pinned = false;
+    };
+
+    struct current
+    {
+        thread_pool* pool;
+        worker* w;
+    };
+
+    std::unique_ptr<worker[]> workers_;
+    std::size_t size_;
+    bool multi_node_ = false;       // workers span NUMA nodes
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    detail::handle_ring injector_;  // guarded by mtx_
+    bool stopped_ = false;          // guarded by mtx_
+    std::atomic<bool> injected_{false};     // injector_ not empty
+    std::atomic<std::size_t> spinning_{0};
+    std::atomic<std::size_t> sleepers_{0};
+    std::atomic<std::size_t> outstanding_{0};
+
+    static current&
+    this_thread() noexcept
+    {
+        static thread_local current c{nullptr, nullptr};
+        return c;
+    }
+
+public:
+    class executor_type;
+
+    explicit
+    thread_pool(std::size_t threads = std::thread::hardware_concurrency())
+        : thread_pool(thread_pool_options{threads, {}})
+    {
+    }
+
+    explicit
+    thread_pool(thread_pool_options const& opts)
+        : workers_(new worker[opts.threads ? opts.threads : 1])
+        , size_(opts.threads ? opts.threads : 1)
+    {
+        auto const& topo = numa_topology::system();
+        for(std::size_t i = 0; i < size_; ++i)
+        {
+            worker& w = workers_[i];
+            w.rng = 0x9e3779b97f4a7c15ull * (i + 1);
+            if(opts.cpus.empty())
+                continue;
+            w.cpu = opts.cpus[i % opts.cpus.size()];
+            w.node = topo.node_of(w.cpu);
+            w.pinned = true;
+            multi_node_ |= w.node != workers_[0].node;
+        }
+    }
+
+    ~thread_pool()
+    {
+        shutdown();
+        destroy();
+    }
+
+    std::size_t size() const noexcept { return size_; }
+
+    executor_type get_executor() noexcept;
+
+    // Run the pool on the calling thread plus size() - 1 helper
+    // threads. Returns when there is no outstanding work: every
+    // posted handle has been resumed and every on_work_started
+    // has been matched by on_work_finished.
+    void
+    run()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stopped_ = outstanding_.load() == 0;
+        }
+        std::vector<std::thread> threads;
+        threads.reserve(size_ - 1);
+        for(std::size_t i = 1; i < size_; ++i)
+            threads.emplace_back([this, i]{ work(workers_[i]); });
+        work(workers_[0]);
+        for(auto& t : threads)
+            t.join();
+    }
+
+    bool
+    running_in_this_thread() const noexcept
+    {
+        return this_thread().pool == this;
+    }
+
+private:
+    void
+    post(std::coroutine_handle<> h)
+    {
+        outstanding_.fetch_add(1, std::memory_order_relaxed);
+        auto& c = this_thread();
+        if(c.pool == this)
+        {
+            worker& w = *c.w;
+            if(w.lifo_run < max_lifo_run)
+            {
+                // Newest handle runs next on this worker; the
+                // previous occupant becomes stealable.
+                h = std::exchange(w.lifo, h);
+                if(!h)
+                    return;
+            }
+            if(!w.deque.push(h))
+                inject(h);
+        }
+        else
+        {
+            inject(h);
+        }
+        wake_one();
+    }
+
+    void
+    inject(std::coroutine_handle<> h)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        injector_.push(h);
+        injected_.store(true, std::memory_order_relaxed);
+    }
+
+    // Called with mtx_ held and the injector not empty
+    std::coroutine_handle<>
+    pop_injected() noexcept
+    {
+        auto h = injector_.pop();
+        if(injector_.empty())
+            injected_.store(false, std::memory_order_relaxed);
+        return h;
+    }
+
+    // A spinning worker is bound to find whatever was just queued, so
+    // a post only pays for a futex wake when every idle worker is
+    // asleep. One wake is enough: the woken worker spins, and while
+    // it does, the posts that follow it make no system call.
+    //
+    // The fence orders publishing the work before reading the
+    // counters. It pairs with the one in park(), so either the
+    // poster sees the sleeper or the sleeper sees the work.
+    void
+    wake_one()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(spinning_.load(std::memory_order_relaxed) != 0)
+            return;
+        if(sleepers_.load(std::memory_order_relaxed) == 0)
+            return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        cv_.notify_one();
+    }
+
+    void
+    work_finished() noexcept
+    {
+        if(outstanding_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        stopped_ = true;
+        cv_.notify_all();
+    }
+
+    std::coroutine_handle<>
+    next(worker& w)
+    {
+        if(++w.tick == fairness_interval)
+        {
+            w.tick = 0;
+            if(injected_.load(std::memory_order_relaxed))
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                if(!injector_.empty())
+                    return pop_injected();
+            }
+            if(auto h = w.deque.steal())
+                return h;
+        }
+        if(w.lifo)
+        {
+            ++w.lifo_run;
+            return std::exchange(w.lifo, nullptr);
+        }
+        w.lifo_run = 0;
+        if(auto h = w.deque.pop())
+            return h;
+        if(injected_.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if(!injector_.empty())
+                return pop_injected();
+        }
+        return steal(w);
+    }
+
+    // Poll for work for a while before parking. At most half the
+    // workers spin at once, so an idle pool quiets down quickly. The
+    // last spinner to find work wakes a sleeper to take its place.
+    std::coroutine_handle<>
+    spin(worker& w)
+    {
+        if(2 * spinning_.load(std::memory_order_relaxed) >= size_)
+            return nullptr;
+        spinning_.fetch_add(1, std::memory_order_seq_cst);
+        std::coroutine_handle<> h;
+        for(unsigned i = 0; i < spin_rounds && !h; ++i)
+        {
+            detail::cpu_relax();
+            if(injected_.load(std::memory_order_relaxed) || has_stealable_work())
+                h = next(w);
+        }
+        if(spinning_.fetch_sub(1, std::memory_order_seq_cst) == 1 && h)
+            wake_one();
+        return h;
+    }
+
+    // Victims on the thief's own NUMA node are tried first, so
+    // stolen frames mostly stay in the memory they were carved from
+    std::coroutine_handle<>
+    steal(worker& self) noexcept
+    {
+        if(size_ == 1)
+            return nullptr;
+        // xorshift64 picks where the victim scan starts
+        self.rng ^= self.rng << 13;
+        self.rng ^= self.rng >> 7;
+        self.rng ^= self.rng << 17;
+        std::size_t start = self.rng % size_;
+        for(int pass = 0; pass < (multi_node_ ? 2 : 1); ++pass)
+        {
+            for(std::size_t i = 0; i < size_; ++i)
+            {
+                worker& v = workers_[(start + i) % size_];
+                if(&v == &self || (multi_node_ && (v.node == self.node) != (pass == 0)))
+                    continue;
+                if(auto h = v.deque.steal())
+                    return h;
+            }
+        }
+        return nullptr;
+    }
+
+    bool
+    has_stealable_work() const noexcept
+    {
+        for(std::size_t i = 0; i < size_; ++i)
+            if(!workers_[i].deque.empty())
+                return true;
+        return false;
+    }
+
+    // Block until work may be available. Returns false to stop.
+    bool
+    park()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        sleepers_.fetch_add(1, std::memory_order_seq_cst);
+        // Orders the count before the emptiness checks; see wake_one
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while(!stopped_ && injector_.empty() && !has_stealable_work())
+            cv_.wait(lock);
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+        return !stopped_;
+    }
+
+    void
+    work(worker& w)
+    {
+        detail::cpu_binding binding(&w.cpu, w.pinned ? 1 : 0);
+        auto& c = this_thread();
+        auto saved = c;
+        c = {this, &w};
+        for(;;)
+        {
+            auto h = next(w);
+            if(!h)
+                h = spin(w);
+            if(h)
+            {
+                h.resume();
+                work_finished();
+                continue;
+            }
+            if(!park())
+                break;
+        }
+        c = saved;
+    }
+};
+
+class thread_pool::executor_type
+{
+    thread_pool* pool_;
+
+    friend class thread_pool;
+
+    explicit
+    executor_type(thread_pool* pool) noexcept
+        : pool_(pool)
+    {
+    }
+
+public:
+    thread_pool& context() const noexcept { return *pool_; }
+
+    void on_work_started() const noexcept
+    {
+        pool_->outstanding_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void on_work_finished() const noexcept
+    {
+        pool_->work_finished();
+    }
+
+    std::coroutine_handle<> dispatch(std::coroutine_handle<> h) const
+    {
+        if(pool_->running_in_this_thread())
+            return h;
+        pool_->post(h);
+        return std::noop_coroutine();
+    }
+
+    void post(std::coroutine_handle<> h) const
+    {
+        pool_->post(h);
+    }
+
+    bool operator==(executor_type const& other) const noexcept
+    {
+        return pool_ == other.pool_;
+    }
+};
+
+inline thread_pool::executor_type
+thread_pool::get_executor() noexcept
+{
+    return executor_type{this};
+}
+
+static_assert(Executor<thread_pool::executor_type>);
+static_assert(IoAwaitable<detail::run_on_awaiter<thread_pool::executor_type, task<int>>>);
+static_assert(ExecutionContext<thread_pool>);
+
+// ============================================================
+// uring - minimal io_uring wrapper (Linux)
+// ============================================================
+
+#if CAPY_HAS_IO_URING
+
+namespace detail {
+
+// An operation submitted to the ring. user_data carries its address
+// and the reaper calls complete with the CQE result and flags.
+struct uring_op
+{
+    void (*complete)(uring_op*, int res, unsigned flags) noexcept;
+};
+
+// An operation that may be cancelled from any thread. Pending
+// cancellations are linked through the operation itself; the links
+// and queued flag are guarded by the owning io_context's mutex.
+struct cancellable_op : uring_op
+{
+    cancellable_op* cancel_prev = nullptr;
+    cancellable_op* cancel_next = nullptr;
+    bool cancel_queued = false;
+};
+
+// Raw-syscall io_uring: ring setup, SQE acquisition, submission and
+// CQE reaping. Also owns an eventfd with a read permanently armed so
+// another thread can interrupt a blocking wait.
+class uring
+{
+    int fd_ = -1;
+    int event_fd_ = -1;
+
+    void* sq_ptr_ = nullptr;
+    void* cq_ptr_ = nullptr;
+    std::size_t sq_len_ = 0;
+    std::size_t cq_len_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    std::size_t sqes_len_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_flags_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned cq_mask_ = 0;
+
+    unsigned sq_local_tail_ = 0;
+    unsigned pending_ = 0;      // SQEs filled but not yet submitted
+    unsigned max_batch_;
+    bool sqpoll_ = false;
+
+    struct wake_op : uring_op
+    {
+        uring* ring;
+        std::uint64_t value;
+    };
+    wake_op wake_op_;
+    uring_op ignore_op_{[](uring_op*, int, unsigned) noexcept {}};
+
+    static void
+    throw_errno(char const* what)
+    {
+        throw std::system_error(errno, std::system_category(), what);
+    }
+
+    // Make filled SQEs visible to the kernel
+    void
+    publish() noexcept
+    {
+        std::atomic_ref<unsigned>(*sq_tail_).store(sq_local_tail_,
+            std::memory_order_release);
+    }
+
+    int
+    enter(unsigned to_submit, unsigned min_complete, unsigned flags) noexcept
+    {
+        return static_cast<int>(::syscall(__NR_io_uring_enter, fd_,
+            to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    void
+    release() noexcept
+    {
+        if(cq_ptr_ != sq_ptr_)
+            ::munmap(cq_ptr_, cq_len_);
+        ::munmap(sq_ptr_, sq_len_);
+        ::close(fd_);
+    }
+
+    void
+    arm_wake()
+    {
+        auto* sqe = get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = event_fd_;
+        sqe->addr = reinterpret_cast<std::uint64_t>(&wake_op_.value);
+        sqe->len = sizeof(wake_op_.value);
+        sqe->user_data = reinterpret_cast<std::uint64_t>(
+            static_cast<uring_op*>(&wake_op_));
+    }
+
+    bool
+    need_wakeup() const noexcept
+    {
+        return std::atomic_ref<unsigned>(*sq_flags_).load(
+            std::memory_order_acquire) & IORING_SQ_NEED_WAKEUP;
+    }
+
+public:
+    // With sqpoll a kernel thread polls the submission ring, so
+    // submitting needs no syscall while that thread is awake. Falls
+    // back to ordinary submission when the kernel refuses SQPOLL.
+    uring(unsigned entries, unsigned max_batch, bool sqpoll,
+        unsigned sqpoll_idle_ms)
+        : max_batch_(max_batch ? max_batch : 1)
+    {
+        io_uring_params params{};
+        if(sqpoll)
+        {
+            params.flags = IORING_SETUP_SQPOLL;
+            params.sq_thread_idle = sqpoll_idle_ms;
+            fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+            sqpoll_ = fd_ >= 0;
+        }
+        if(fd_ < 0)
+        {
+            params = io_uring_params{};
+            fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        }
+        if(fd_ < 0)
+            throw_errno("io_uring_setup");
+
+        sq_len_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_len_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(single)
+            sq_len_ = cq_len_ = std::max(sq_len_, cq_len_);
+
+        sq_ptr_ = ::mmap(nullptr, sq_len_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if(sq_ptr_ == MAP_FAILED)
+        {
+            ::close(fd_);
+            throw_errno("mmap");
+        }
+        cq_ptr_ = single ? sq_ptr_ : ::mmap(nullptr, cq_len_,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+            IORING_OFF_CQ_RING);
+        sqes_len_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = ::mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if(cq_ptr_ == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            int e = errno;
+            if(sqes != MAP_FAILED)
+                ::munmap(sqes, sqes_len_);
+            if(cq_ptr_ == MAP_FAILED)
+                cq_ptr_ = sq_ptr_;
+            release();
+            errno = e;
+            throw_errno("mmap");
+        }
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        auto* sq = static_cast<char*>(sq_ptr_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_flags_ = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+        sq_local_tail_ = *sq_tail_;
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        auto* cq = static_cast<char*>(cq_ptr_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        event_fd_ = ::eventfd(0, EFD_CLOEXEC);
+        if(event_fd_ < 0)
+        {
+            int e = errno;
+            ::munmap(sqes_, sqes_len_);
+            release();
+            errno = e;
+            throw_errno("eventfd");
+        }
+        wake_op_.complete = [](uring_op* op, int, unsigned) noexcept {
+            static_cast<wake_op*>(op)->ring->arm_wake();
+        };
+        wake_op_.ring = this;
+        arm_wake();
+        submit();
+    }
+
+    uring(uring const&) = delete;
+    uring& operator=(uring const&) = delete;
+
+    ~uring()
+    {
+        ::close(event_fd_);
+        ::munmap(sqes_, sqes_len_);
+        release();
+    }
+
+    bool sqpoll() const noexcept { return sqpoll_; }
+
+    // Returns a zeroed SQE. Queued entries are submitted first when
+    // the batch limit is reached or the submission ring is full.
+    io_uring_sqe*
+    get_sqe()
+    {
+        if(pending_ >= max_batch_)
+            submit();
+        unsigned tail = sq_local_tail_;
+        unsigned head = std::atomic_ref<unsigned>(*sq_head_).load(
+            std::memory_order_acquire);
+        if(tail - head >= sq_entries_)
+        {
+            submit();
+            if(sqpoll_)
+                enter(0, 0, IORING_ENTER_SQ_WAIT);
+            head = std::atomic_ref<unsigned>(*sq_head_).load(
+                std::memory_order_acquire);
+            if(tail - head >= sq_entries_)
+                throw std::system_error(std::make_error_code(
+                    std::errc::resource_unavailable_try_again), "io_uring sq full");
+        }
+        unsigned i = tail & sq_mask_;
+        io_uring_sqe* sqe = &sqes_[i];
+        *sqe = io_uring_sqe{};
+        sq_array_[i] = i;
+        sq_local_tail_ = tail + 1;
+        ++pending_;
+        return sqe;
+    }
+
+    // Hand every queued SQE to the kernel in one io_uring_enter
+    void
+    submit()
+    {
+        if(pending_ == 0)
+            return;
+        publish();
+        if(sqpoll_)
+        {
+            pending_ = 0;
+            if(need_wakeup())
+                enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+            return;
+        }
+        while(pending_ > 0)
+        {
+            int r = enter(pending_, 0, 0);
+            if(r < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                throw_errno("io_uring_enter");
+            }
+            pending_ -= static_cast<unsigned>(r);
+        }
+    }
+
+    // Submit, then block until at least one completion is available
+    void
+    wait()
+    {
+        publish();
+        unsigned flags = IORING_ENTER_GETEVENTS;
+        if(sqpoll_)
+        {
+            pending_ = 0;
+            if(need_wakeup())
+                flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+        for(;;)
+        {
+            int r = enter(pending_, 1, flags);
+            if(r >= 0)
+            {
+                pending_ -= std::min(pending_, static_cast<unsigned>(r));
+                return;
+            }
+            if(errno != EINTR)
+                throw_errno("io_uring_enter");
+        }
+    }
+
+    // Complete every available CQE. The whole batch is consumed and
+    // the head published once before any completion handler runs, so
+    // handlers may queue new SQEs freely. Returns the number reaped.
+    std::size_t
+    reap() noexcept
+    {
+        constexpr unsigned batch = 64;
+        std::size_t n = 0;
+        for(;;)
+        {
+            unsigned head = *cq_head_;
+            unsigned tail = std::atomic_ref<unsigned>(*cq_tail_).load(
+                std::memory_order_acquire);
+            unsigned count = std::min(tail - head, batch);
+            if(count == 0)
+                return n;
+            io_uring_cqe cqes[batch];
+            for(unsigned i = 0; i < count; ++i)
+                cqes[i] = cqes_[(head + i) & cq_mask_];
+            std::atomic_ref<unsigned>(*cq_head_).store(head + count,
+                std::memory_order_release);
+            for(unsigned i = 0; i < count; ++i)
+            {
+                auto* op = reinterpret_cast<uring_op*>(cqes[i].user_data);
+                op->complete(op, cqes[i].res, cqes[i].flags);
+            }
+            n += count;
+        }
+    }
+
+    // Queue an IORING_OP_ASYNC_CANCEL for target. The CQE of the
+    // cancel request itself is discarded.
+    void
+    cancel(uring_op* target)
+    {
+        auto* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = reinterpret_cast<std::uint64_t>(target);
+        sqe->user_data = reinterpret_cast<std::uint64_t>(&ignore_op_);
+    }
+
+    // io_uring_register, for resources such as buffer rings
+    void
+    register_resource(unsigned opcode, void* arg, unsigned nr)
+    {
+        if(::syscall(__NR_io_uring_register, fd_, opcode, arg, nr) < 0)
+            throw_errno("io_uring_register");
+    }
+
+    void
+    unregister_resource(unsigned opcode, void* arg, unsigned nr) noexcept
+    {
+        ::syscall(__NR_io_uring_register, fd_, opcode, arg, nr);
+    }
+
+    // Interrupt wait() from any thread
+    void
+    wake() noexcept
+    {
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto r = ::write(event_fd_, &one, sizeof(one));
+    }
+};
+
+} // namespace detail
+
+#endif // CAPY_HAS_IO_URING
+
+// ============================================================
+// io_context - single-threaded run-queue execution context
+// ============================================================
+
+// Tuning knobs for the context. The io_uring settings are ignored
+// where io_uring is unavailable.
+struct io_context_options
+{
+    // Submission ring size
+    unsigned entries = 256;
+
+    // SQEs queued before an early io_uring_enter inside a turn
+    unsigned max_batch = 64;
+
+    // Let a kernel thread poll the submission ring
+    bool sqpoll = false;
+
+    // Idle time before the SQPOLL thread sleeps
+    unsigned sqpoll_idle_ms = 1000;
+
+    // When not empty, run() pins the calling thread to these CPUs
+    // and allocates frames from the first one's NUMA node, for the
+    // duration of the call
+    std::vector<unsigned> cpus;
+};
+
+// post() always enqueues and run() drains the queue on the calling
+// thread, so a chain of tasks posting to one another unwinds back to
+// the loop between steps instead of nesting resume() calls. On Linux
+// the context owns an io_uring, created on first use, and run()
+// blocks in the kernel while I/O is outstanding.
+//
+// run() works in turns: it resumes the handles queued at the start
+// of the turn, then submits every SQE they queued in one
+// io_uring_enter and reaps all available completions, whose handles
+// form the next turn.
+class io_context : public execution_context
+{
+    detail::handle_ring local_;     // touched only inside run()
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    detail::handle_ring remote_;    // guarded by mtx_
+    std::atomic<bool> remote_ready_{false};
+    std::atomic<bool> parked_{false};   // set under mtx_
+    std::atomic<std::size_t> outstanding_{0};
+    io_context_options opts_;
+#if CAPY_HAS_IO_URING
+    std::unique_ptr<detail::uring> ring_;
+    detail::cancellable_op* cancels_ = nullptr;     // guarded by mtx_
+    std::atomic<bool> cancels_ready_{false};
+#endif
+
+    static io_context*&
+    this_thread() noexcept
+    {
+        static thread_local io_context* ctx = nullptr;
+        return ctx;
+    }
+
+public:
+    class executor_type;
+
+    explicit
+    io_context(io_context_options opts = {}) noexcept
+        : opts_(std::move(opts))
+    {
+    }
+
+    // Services such as timers post here, so they go first
+    ~io_context()
+    {
+        shutdown();
+        destroy();
+    }
+
+    executor_type get_executor() noexcept;
+
+    bool
+    running_in_this_thread() const noexcept
+    {
+        return this_thread() == this;
+    }
+
+#if CAPY_HAS_IO_URING
+    // The context's ring, created on first use. Call from the thread
+    // running the context, or before run() starts.
+    detail::uring&
+    ring()
+    {
+        if(!ring_)
+        {
+            auto r = std::make_unique<detail::uring>(opts_.entries,
+                opts_.max_batch, opts_.sqpoll, opts_.sqpoll_idle_ms);
+            std::lock_guard<std::mutex> lock(mtx_);
+            ring_ = std::move(r);
+        }
+        return *ring_;
+    }
+
+    // The ring if one was created, without creating it
+    detail::uring* existing_ring() noexcept { return ring_.get(); }
+
+    // Ask the loop to cancel op. Callable from any thread, typically
+    // from a stop callback; the cancel is submitted at the end of the
+    // current turn, or immediately if run() is blocked.
+    void
+    request_cancel(detail::cancellable_op* op) noexcept
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        op->cancel_queued = true;
+        op->cancel_prev = nullptr;
+        op->cancel_next = cancels_;
+        if(cancels_)
+            cancels_->cancel_prev = op;
+        cancels_ = op;
+        cancels_ready_.store(true, std::memory_order_release);
+        if(!running_in_this_thread())
+            wake_locked();
+    }
+
+    // Drop a cancel request for op, which has completed. Call on the
+    // loop thread once the stop callback that might queue it is gone.
+    void
+    withdraw_cancel(detail::cancellable_op* op) noexcept
+    {
+        if(!op->cancel_queued)
+            return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        if(op->cancel_prev)
+            op->cancel_prev->cancel_next = op->cancel_next;
+        else
+            cancels_ = op->cancel_next;
+        if(op->cancel_next)
+            op->cancel_next->cancel_prev = op->cancel_prev;
+        op->cancel_queued = false;
+    }
+#endif
+
+    // Resume queued handles until there is no outstanding work.
+    // Returns the number of handles resumed.
+    std::size_t
+    run()
+    {
+        detail::cpu_binding binding(opts_.cpus.data(), opts_.cpus.size());
+        auto* saved = std::exchange(this_thread(), this);
+        std::size_t n = 0;
+        while(!local_.empty() || fill())
+        {
+            for(std::size_t k = local_.size(); k > 0; --k)
+            {
+                local_.pop().resume();
+                ++n;
+                work_finished();
+            }
+            end_turn();
+        }
+        this_thread() = saved;
+        return n;
+    }
+
+private:
+    void
+    take_remote_locked()
+    {
+        while(!remote_.empty())
+            local_.push(remote_.pop());
+        remote_ready_.store(false, std::memory_order_relaxed);
+    }
+
+#if CAPY_HAS_IO_URING
+    // Queue requested cancellations, submit and reap
+    void
+    poll_ring()
+    {
+        if(cancels_ready_.load(std::memory_order_acquire))
+        {
+            detail::cancellable_op* list;
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                list = std::exchange(cancels_, nullptr);
+                for(auto* op = list; op; op = op->cancel_next)
+                    op->cancel_queued = false;
+                cancels_ready_.store(false, std::memory_order_relaxed);
+            }
+            // No operation can complete before these are submitted,
+            // so the list stays valid without the lock
+            for(auto* op = list; op; op = op->cancel_next)
+                ring_->cancel(op);
+        }
+        ring_->submit();
+        ring_->reap();
+    }
+#endif
+
+    // Flush this turn's submissions, reap completions, and pick up
+    // handles posted from other threads
+    void
+    end_turn()
+    {
+#if CAPY_HAS_IO_URING
+        if(ring_)
+            poll_ring();
+#endif
+        if(remote_ready_.load(std::memory_order_acquire))
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            take_remote_locked();
+        }
+    }
+
+    // Refill the empty local queue from completions and foreign
+    // posts, blocking as needed. Returns false when no work is
+    // outstanding.
+    bool
+    fill()
+    {
+        for(;;)
+        {
+#if CAPY_HAS_IO_URING
+            if(ring_)
+                poll_ring();
+            if(!local_.empty())
+                return true;
+#endif
+            std::unique_lock<std::mutex> lock(mtx_);
+            if(!remote_.empty())
+            {
+                // Take everything posted from other threads at once
+                take_remote_locked();
+                return true;
+            }
+            if(outstanding_.load(std::memory_order_acquire) == 0)
+                return false;
+#if CAPY_HAS_IO_URING
+            if(ring_)
+            {
+                // Queued without a wake while the loop was awake
+                if(cancels_ready_.load(std::memory_order_relaxed))
+                    continue;
+                parked_.store(true, std::memory_order_relaxed);
+                lock.unlock();
+                ring_->wait();
+                parked_.store(false, std::memory_order_relaxed);
+                continue;
+            }
+#endif
+            parked_.store(true, std::memory_order_relaxed);
+            cv_.wait(lock);
+            parked_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    // Wake run() if it is blocked; called with mtx_ held. Everything
+    // the loop would wake for is published under mtx_, and the loop
+    // checks it under mtx_ before parking, so only the first caller
+    // after it parks pays for the eventfd write or futex wake.
+    // Posts to a busy loop make no system call at all.
+    void
+    wake_locked() noexcept
+    {
+        if(!parked_.exchange(false, std::memory_order_relaxed))
+            return;
+#if CAPY_HAS_IO_URING
+        if(ring_)
+            return ring_->wake();
+#endif
+        cv_.notify_one();
+    }
+
+    void
+    post(std::coroutine_handle<> h)
+    {
+        outstanding_.fetch_add(1, std::memory_order_relaxed);
+        if(running_in_this_thread())
+            return local_.push(h);
+        std::lock_guard<std::mutex> lock(mtx_);
+        remote_.push(h);
+        remote_ready_.store(true, std::memory_order_release);
+        wake_locked();
+    }
+
+    void
+    work_finished() noexcept
+    {
+        if(outstanding_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        if(running_in_this_thread())
+            return;
+        std::lock_guard<std::mutex> lock(mtx_);
+        wake_locked();
+    }
+};
+
+class io_context::executor_type
+{
+    io_context* ctx_;
+
+    friend class io_context;
+
+    explicit
+    executor_type(io_context* ctx) noexcept
+        : ctx_(ctx)
+    {
+    }
+
+public:
+    io_context& context() const noexcept { return *ctx_; }
+
+    void on_work_started() const noexcept
+    {
+        ctx_->outstanding_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void on_work_finished() const noexcept
+    {
+        ctx_->work_finished();
+    }
+
+    std::coroutine_handle<> dispatch(std::coroutine_handle<> h) const
+    {
+        if(ctx_->running_in_this_thread())
+            return h;
+        ctx_->post(h);
+        return std::noop_coroutine();
+    }
+
+    void post(std::coroutine_handle<> h) const
+    {
+        ctx_->post(h);
+    }
+
+    bool operator==(executor_type const& other) const noexcept
+    {
+        return ctx_ == other.ctx_;
+    }
+};
+
+inline io_context::executor_type
+io_context::get_executor() noexcept
+{
+    return executor_type{this};
+}
+
+static_assert(Executor<io_context::executor_type>);
+static_assert(ExecutionContext<io_context>);
+
+// ============================================================
+// any_executor - owning type-erased executor
+// ============================================================
+
+namespace detail {
+
+struct any_executor_vtable : executor_vtable
+{
+    void (*copy)(void*, void const*) noexcept;
+    void (*destroy)(void*) noexcept;
+};
+
+template<class Ex>
+inline constexpr any_executor_vtable any_vtable_for = {
+    vtable_for<Ex>,
+    [](void* dst, void const* src) noexcept {
+        ::new(dst) Ex(*static_cast<Ex const*>(src));
+    },
+    [](void* p) noexcept {
+        static_cast<Ex*>(p)->~Ex();
+    },
+};
+
+// Uniform view used when the stored type is not one of Known
+struct erased_executor_view
+{
+    void const* ex;
+    executor_vtable const* vt;
+
+    execution_context& context() const noexcept { return vt->context(ex); }
+    void on_work_started() const noexcept { vt->on_work_started(ex); }
+    void on_work_finished() const noexcept { vt->on_work_finished(ex); }
+    std::coroutine_handle<> dispatch(std::coroutine_handle<> h) const { return vt->dispatch(ex, h); }
+    void post(std::coroutine_handle<> h) const { vt->post(ex, h); }
+};
+
+} // namespace detail
+
+// Owns a copy of any executor up to two pointers in size, stored
+// inline. When the stored type is one of Known, operations branch
+// on a small index and call the executor directly instead of going
+// through the vtable, letting the compiler inline them.
+template<class... Known>
+class basic_any_executor
+{
+    static constexpr std::size_t buffer_size = 2 * sizeof(void*);
+
+    static_assert(sizeof...(Known) < 255);
+    static_assert(((sizeof(Known) <= buffer_size &&
+        alignof(Known) <= alignof(void*)) && ...));
+
+    alignas(void*) unsigned char buf_[buffer_size];
+    detail::any_executor_vtable const* vt_ = nullptr;
+    std::uint8_t index_ = 0;
+
+    template<class... K>
+    friend class basic_any_executor;
+    friend class executor_ref;
+
+    template<class Ex>
+    static constexpr std::uint8_t
+    index_of() noexcept
+    {
+        std::uint8_t i = 0, r = 0;
+        ((++i, r = std::is_same_v<Ex, Known> ? i : r), ...);
+        return r;
+    }
+
+    template<std::size_t I, class F>
+    decltype(auto)
+    visit_at(F& f) const
+    {
+        if constexpr (I == sizeof...(Known))
+        {
+            return f(detail::erased_executor_view{buf_, vt_});
+        }
+        else
+        {
+            using Ex = std::tuple_element_t<I, std::tuple<Known...>>;
+            if(index_ == I + 1)
+                return f(*std::launder(reinterpret_cast<Ex const*>(buf_)));
+            return visit_at<I + 1>(f);
+        }
+    }
+
+    template<class F>
+    decltype(auto)
+    visit(F&& f) const
+    {
+        return visit_at<0>(f);
+    }
+
+public:
+    basic_any_executor() = default;
+
+    template<class Ex>
+        requires (!std::same_as<std::decay_t<Ex>, basic_any_executor>) &&
+            Executor<Ex> &&
+            (sizeof(Ex) <= buffer_size) &&
+            (alignof(Ex) <= alignof(void*))
+    basic_any_executor(Ex const& ex) noexcept
+        : vt_(&detail::any_vtable_for<Ex>)
+        , index_(index_of<Ex>())
+    {
+        ::new(static_cast<void*>(buf_)) Ex(ex);
+    }
+
+    basic_any_executor(basic_any_executor const& other) noexcept
+        : vt_(other.vt_)
+        , index_(other.index_)
+    {
+        if(vt_)
+            vt_->copy(buf_, other.buf_);
+    }
+
+    basic_any_executor&
+    operator=(basic_any_executor const& other) noexcept
+    {
+        if(this != &other)
+        {
+            if(vt_)
+                vt_->destroy(buf_);
+            vt_ = other.vt_;
+            index_ = other.index_;
+            if(vt_)
+                vt_->copy(buf_, other.buf_);
+        }
+        return *this;
+    }
+
+    ~basic_any_executor()
+    {
+        if(vt_)
+            vt_->destroy(buf_);
+    }
+
+    explicit operator bool() const noexcept { return vt_ != nullptr; }
+
+    execution_context& context() const noexcept
+    {
+        return visit([](auto const& e) noexcept -> execution_context& {
+            return e.context(); });
+    }
+
+    void on_work_started() const noexcept
+    {
+        visit([](auto const& e) noexcept { e.on_work_started(); });
+    }
+
+    void on_work_finished() const noexcept
+    {
+        visit([](auto const& e) noexcept { e.on_work_finished(); });
+    }
+
+    std::coroutine_handle<> dispatch(std::coroutine_handle<> h) const
+    {
+        return visit([h](auto const& e) -> std::coroutine_handle<> {
+            return e.dispatch(h); });
+    }
+
+    void post(std::coroutine_handle<> h) const
+    {
+        visit([h](auto const& e) { e.post(h); });
+    }
+
+    bool operator==(basic_any_executor const& other) const noexcept
+    {
+        if(vt_ != other.vt_)
+            return false;
+        return !vt_ || vt_->equals(buf_, other.buf_);
+    }
+};
+
+template<class... Known>
+executor_ref::executor_ref(basic_any_executor<Known...> const& ex) noexcept
+    : ex_(ex.vt_ ? ex.buf_ : nullptr)
+    , vt_(ex.vt_)
+{
+}
+
+using any_executor = basic_any_executor<
+    inline_executor,
+    io_context::executor_type,
+    thread_pool::executor_type>;
+
+static_assert(Executor<any_executor>);
+static_assert(sizeof(any_executor) <= 4 * sizeof(void*));
+
+// ============================================================
+// strand - serialized execution over another executor
+// ============================================================
+
+namespace detail {
+
+// Vyukov's intrusive multi-producer single-consumer queue. A push
+// is one exchange plus one store; the consumer never waits on a
+// lock. A pop may miss a node whose producer is between those two
+// steps, so a consumer that knows a node is due retries.
+class mpsc_queue
+{
+public:
+    struct node
+    {
+        std::atomic<node*> next{nullptr};
+    };
+
+private:
+    std::atomic<node*> head_;       // most recently pushed
+    node* tail_;                    // next to pop, consumer only
+    node stub_;
+
+public:
+    mpsc_queue() noexcept
+        : head_(&stub_)
+        , tail_(&stub_)
+    {
+    }
+
+    mpsc_queue(mpsc_queue const&) = delete;
+    mpsc_queue& operator=(mpsc_queue const&) = delete;
+
+    void
+    push(node* n) noexcept
+    {
+        n->next.store(nullptr, std::memory_order_relaxed);
+        node* prev = head_.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    node*
+    pop() noexcept
+    {
+        node* tail = tail_;
+        node* next = tail->next.load(std::memory_order_acquire);
+        if(tail == &stub_)
+        {
+            if(!next)
+                return nullptr;
+            tail_ = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if(next)
+        {
+            tail_ = next;
+            return tail;
+        }
+        if(tail != head_.load(std::memory_order_acquire))
+            return nullptr;
+        // tail is the last node; requeue the stub behind it
+        push(&stub_);
+        next = tail->next.load(std::memory_order_acquire);
+        if(next)
+        {
+            tail_ = next;
+            return tail;
+        }
+        return nullptr;
+    }
+};
+
+// The strand whose handles this thread is resuming, if any
+inline void const*&
+current_strand() noexcept
+{
+    static thread_local void const* s = nullptr;
+    return s;
+}
+
+// Queue node of a strand. Nodes carry no strand, so any strand can
+// reuse one.
+struct strand_item : mpsc_queue::node
+{
+    std::coroutine_handle<> h;
+};
+
+inline void
+free_strand_items(mpsc_queue::node* p) noexcept
+{
+    while(p)
+    {
+        auto* it = static_cast<strand_item*>(p);
+        p = p->next.load(std::memory_order_relaxed);
+        it->~strand_item();
+        get_recycling_frame_pool()->deallocate(
+            it, sizeof(strand_item), alignof(strand_item));
+    }
+}
+
+// Nodes this thread has taken from a strand's spare list and not
+// yet posted. Returned to the frame pool at thread exit.
+class strand_item_cache
+{
+    mpsc_queue::node* head_ = nullptr;
+
+public:
+    ~strand_item_cache()
+    {
+        free_strand_items(head_);
+    }
+
+    static strand_item_cache&
+    get() noexcept
+    {
+        static thread_local strand_item_cache c;
+        return c;
+    }
+
+    bool empty() const noexcept { return !head_; }
+
+    strand_item*
+    pop() noexcept
+    {
+        auto* p = head_;
+        head_ = p->next.load(std::memory_order_relaxed);
+        return static_cast<strand_item*>(p);
+    }
+
+    void
+    assign(mpsc_queue::node* list) noexcept
+    {
+        head_ = list;
+    }
+};
+
+// Coroutine that resumes a strand's handles, one batch per resume
+struct strand_pump
+{
+    struct promise_type
+    {
+        strand_pump
+        get_return_object() noexcept
+        {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+};
+
+// State shared by copies of a strand. count_ is the number of
+// handles posted but not yet resumed; the post that raises it from
+// zero schedules the pump on the inner executor, and the pump stays
+// scheduled until it brings it back to zero. The count is therefore
+// also the running flag, and no handle can be queued without a pump
+// to run it. While scheduled, the pump holds a reference to the
+// state, so dropping the last strand with handles queued is safe.
+//
+// Queue nodes are recycled. The pump collects the nodes it has
+// drained and publishes them as one list when spare_ is empty. A
+// poster whose thread has no cached nodes takes the whole list into
+// its strand_item_cache, and only allocates from the frame pool when
+// there is none. Both sides compare spare_ only against null, so
+// there is no ABA hazard. Once the strands' queues have reached
+// their peak depth, posting allocates nothing and takes no lock.
+template<class Ex>
+class strand_impl
+    : public std::enable_shared_from_this<strand_impl<Ex>>
+{
+    using item = strand_item;
+
+    // Suspends the pump, then reschedules it if handles arrived
+    // while it ran. Touches nothing once the count reaches zero.
+    struct yield_awaiter
+    {
+        strand_impl* s_;
+        std::size_t done_;
+
+        bool await_ready() const noexcept { return false; }
+
+        void
+        await_suspend(std::coroutine_handle<> h) const noexcept
+        {
+            auto self = std::move(s_->self_);
+            if(s_->count_.fetch_sub(done_, std::memory_order_acq_rel) != done_)
+            {
+                s_->self_ = std::move(self);
+                s_->inner_.post(h);
+            }
+            // May release the last reference and destroy this frame
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    Ex inner_;
+    mpsc_queue queue_;
+    std::atomic<std::size_t> count_{0};
+    std::shared_ptr<strand_impl> self_;     // set while scheduled
+    std::coroutine_handle<> pump_;
+    std::atomic<mpsc_queue::node*> spare_{nullptr};
+    mpsc_queue::node* drained_ = nullptr;   // pump only
+
+    item*
+    acquire()
+    {
+        auto& cache = strand_item_cache::get();
+        if(cache.empty())
+        {
+            auto* p = spare_.exchange(nullptr, std::memory_order_acquire);
+            if(!p)
+            {
+                void* raw = get_recycling_frame_pool()->allocate(sizeof(item), alignof(item));
+                return ::new(raw) item;
+            }
+            cache.assign(p);
+        }
+        return cache.pop();
+    }
+
+    static strand_pump
+    run(strand_impl* s)
+    {
+        for(;;)
+            co_await yield_awaiter{s, s->drain()};
+    }
+
+    // Resume the handles queued when the pump started. Later ones
+    // wait for the next turn, so a busy strand shares its thread.
+    std::size_t
+    drain() noexcept
+    {
+        void const* prev = std::exchange(current_strand(), this);
+        std::size_t n = count_.load(std::memory_order_acquire);
+        for(std::size_t i = 0; i < n; ++i)
+        {
+            mpsc_queue::node* p;
+            while(!(p = queue_.pop()))
+                std::this_thread::yield();
+            auto h = static_cast<item*>(p)->h;
+            p->next.store(drained_, std::memory_order_relaxed);
+            drained_ = p;
+            h.resume();
+        }
+        current_strand() = prev;
+        mpsc_queue::node* expected = nullptr;
+        if(drained_ && spare_.compare_exchange_strong(expected, drained_,
+                std::memory_order_release, std::memory_order_relaxed))
+            drained_ = nullptr;
+        return n;
+    }
+
+public:
+    explicit strand_impl(Ex const& ex)
+        : inner_(ex)
+        , pump_(run(this).h)
+    {
+    }
+
+    // Handles still queued are abandoned, as by the contexts
+    ~strand_impl()
+    {
+        pump_.destroy();
+        while(auto* p = queue_.pop())
+        {
+            p->next.store(nullptr, std::memory_order_relaxed);
+            free_strand_items(p);
+        }
+        free_strand_items(drained_);
+        free_strand_items(spare_.load(std::memory_order_acquire));
+    }
+
+    Ex const& inner() const noexcept { return inner_; }
+
+    bool
+    running_in_this_thread() const noexcept
+    {
+        return current_strand() == this;
+    }
+
+    void
+    post(std::coroutine_handle<> h)
+    {
+        auto* it = acquire();
+        it->h = h;
+        queue_.push(it);
+        if(count_.fetch_add(1, std::memory_order_acq_rel) == 0)
+        {
+            self_ = this->shared_from_this();
+            inner_.post(pump_);
+        }
+    }
+};
+
+} // namespace detail
+
+// Runs posted handles one at a time and in order, on the inner
+// executor, so coroutines sharing a strand need no mutex. Posting
+// takes no lock. dispatch resumes inline only when the caller is
+// already running on this strand. Copies share one queue and
+// compare equal.
+template<Executor Ex>
+class strand
+{
+    std::shared_ptr<detail::strand_impl<Ex>> impl_;
+
+public:
+    explicit strand(Ex const& ex)
+        : impl_(std::make_shared<detail::strand_impl<Ex>>(ex))
+    {
+    }
+
+    Ex const& get_inner_executor() const noexcept { return impl_->inner(); }
+
+    bool
+    running_in_this_thread() const noexcept
+    {
+        return impl_->running_in_this_thread();
+    }
+
+    auto& context() const noexcept { return impl_->inner().context(); }
+
+    void on_work_started() const noexcept { impl_->inner().on_work_started(); }
+    void on_work_finished() const noexcept { impl_->inner().on_work_finished(); }
+
+    std::coroutine_handle<> dispatch(std::coroutine_handle<> h) const
+    {
+        if(impl_->running_in_this_thread())
+            return h;
+        impl_->post(h);
+        return std::noop_coroutine();
+    }
+
+    void post(std::coroutine_handle<> h) const
+    {
+        impl_->post(h);
+    }
+
+    bool operator==(strand const& other) const noexcept
+    {
+        return impl_ == other.impl_;
+    }
+};
+
+static_assert(Executor<strand<io_context::executor_type>>);
+static_assert(Executor<strand<thread_pool::executor_type>>);
+
+// ============================================================
+// async_semaphore, async_mutex, channel - coroutine synchronization
+// ============================================================
+
+// Waiting suspends the coroutine rather than the thread. Each
+// waiter is the awaiter itself, linked into the primitive's list,
+// so waiting allocates nothing. A waiter is resumed by posting to
+// the executor of its own io_env, after the primitive's mutex is
+// released, and a stop request on its io_env takes it off the list
+// with std::errc::operation_canceled.
+// Ownership is handed over in FIFO order: the waiter woken by a
+// release already holds what it waited for.
+
+namespace detail {
+
+class waiter_list;
+
+struct async_waiter
+{
+    async_waiter* next = nullptr;
+    async_waiter* prev = nullptr;
+    std::coroutine_handle<> h;
+    executor_ref ex;
+    std::error_code ec;
+    bool queued = false;        // guarded by the owner's mutex
+    bool stop_seen = false;     // guarded by the owner's mutex
+
+    // Called with the owner's mutex held, once unlinked: queues the
+    // waiter on ready, which is posted after the mutex is released
+    void wake(waiter_list& ready, std::error_code e = {}) noexcept;
+};
+
+class waiter_list
+{
+    async_waiter* head_ = nullptr;
+    async_waiter* tail_ = nullptr;
+
+public:
+    bool empty() const noexcept { return head_ == nullptr; }
+
+    void
+    push_back(async_waiter* w) noexcept
+    {
+        w->next = nullptr;
+        w->prev = tail_;
+        if(tail_)
+            tail_->next = w;
+        else
+            head_ = w;
+        tail_ = w;
+    }
+
+    async_waiter*
+    pop_front() noexcept
+    {
+        auto* w = head_;
+        head_ = w->next;
+        if(head_)
+            head_->prev = nullptr;
+        else
+            tail_ = nullptr;
+        return w;
+    }
+
+    void
+    remove(async_waiter* w) noexcept
+    {
+        if(w->prev)
+            w->prev->next = w->next;
+        else
+            head_ = w->next;
+        if(w->next)
+            w->next->prev = w->prev;
+        else
+            tail_ = w->prev;
+    }
+
+    // Resumes every waiter on the list. Called without the owner's
+    // mutex; a waiter may be destroyed as soon as it is posted.
+    void
+    post_all() noexcept
+    {
+        while(head_)
+        {
+            auto* w = head_;
+            head_ = w->next;
+            executor_ref x = w->ex;
+            std::coroutine_handle<> h = w->h;
+            x.post(h);
+        }
+        tail_ = nullptr;
+    }
+};
+
+inline
+void
+async_waiter::
+wake(waiter_list& ready, std::error_code e) noexcept
+{
+    ec = e;
+    queued = false;
+    ready.push_back(this);
+}
+
+// The suspension protocol shared by every primitive. Derived
+// supplies owner_mutex(), waiters() and try_complete(ready), which
+// runs under the owner's mutex, queues any waiter it completes on
+// ready, and returns true once the operation is done. The stop callback is installed before the waiter is queued,
+// so it never races the queueing, and a stop seen before then makes
+// the operation finish without suspending.
+template<class Derived>
+class waiting_awaiter : protected async_waiter
+{
+    struct on_stop
+    {
+        waiting_awaiter* self;
+
+        void operator()() const noexcept
+        {
+            self->cancel();
+        }
+    };
+
+    std::optional<inplace_stop_callback<on_stop>> stop_cb_;
+    bool waited_ = false;
+
+    Derived& derived() noexcept { return static_cast<Derived&>(*this); }
+
+    void
+    cancel() noexcept
+    {
+        auto& d = derived();
+        waiter_list ready;
+        {
+            std::lock_guard<std::mutex> lock(d.owner_mutex());
+            if(!queued)
+            {
+                stop_seen = true;
+                return;
+            }
+            d.waiters().remove(this);
+            wake(ready, std::make_error_code(std::errc::operation_canceled));
+        }
+        ready.post_all();
+    }
+
+protected:
+    waiting_awaiter() = default;
+
+    // Moved only before the operation starts
+    waiting_awaiter(waiting_awaiter&&) noexcept
+    {
+    }
+
+    // Called first by Derived::await_resume
+    void
+    finish() noexcept
+    {
+        // Waits out a stop callback running on another thread
+        stop_cb_.reset();
+        if(waited_)
+            ex.on_work_finished();
+    }
+
+public:
+    bool await_ready() const noexcept { return false; }
+
+    bool
+    await_suspend(std::coroutine_handle<> cont, io_env const* env)
+    {
+        auto& d = derived();
+        waiter_list ready;
+        bool done;
+        {
+            std::lock_guard<std::mutex> lock(d.owner_mutex());
+            done = d.try_complete(ready);
+        }
+        ready.post_all();
+        if(done)
+            return false;
+        if(env->stop_token.stop_requested())
+        {
+            ec = std::make_error_code(std::errc::operation_canceled);
+            return false;
+        }
+        h = cont;
+        ex = env->executor;
+        if(env->stop_token.stop_possible())
+            stop_cb_.emplace(env->stop_token, on_stop{this});
+        {
+            std::lock_guard<std::mutex> lock(d.owner_mutex());
+            if(stop_seen)
+            {
+                ec = std::make_error_code(std::errc::operation_canceled);
+                return false;
+            }
+            done = d.try_complete(ready);
+            if(!done)
+            {
+                // Keeps the context running while the coroutine waits
+                ex.on_work_started();
+                waited_ = true;
+                queued = true;
+                d.waiters().push_back(this);
+            }
+        }
+        ready.post_all();
+        return !done;
+    }
+};
+
+} // namespace detail
+
+// Counting semaphore. acquire() completes with an error_code, set
+// only when a stop request removed the waiter.
+class async_semaphore
+{
+    class acquire_awaiter : public detail::waiting_awaiter<acquire_awaiter>
+    {
+        friend class detail::waiting_awaiter<acquire_awaiter>;
+
+        async_semaphore* s_;
+
+        std::mutex& owner_mutex() noexcept { return s_->mtx_; }
+        detail::waiter_list& waiters() noexcept { return s_->waiters_; }
+        bool try_complete(detail::waiter_list&) noexcept { return s_->try_acquire_locked(); }
+
+    public:
+        explicit
+        acquire_awaiter(async_semaphore& s) noexcept
+            : s_(&s)
+        {
+        }
+
+        acquire_awaiter(acquire_awaiter&& other) noexcept
+            : detail::waiting_awaiter<acquire_awaiter>(std::move(other))
+            , s_(other.s_)
+        {
+        }
+
+        std::error_code
+        await_resume() noexcept
+        {
+            finish();
+            return ec;
+        }
+    };
+
+    std::mutex mtx_;
+    detail::waiter_list waiters_;   // guarded by mtx_
+    std::size_t count_;             // guarded by mtx_
+
+    bool
+    try_acquire_locked() noexcept
+    {
+        if(count_ == 0)
+            return false;
+        --count_;
+        return true;
+    }
+
+public:
+    explicit
+    async_semaphore(std::size_t initial = 0) noexcept
+        : count_(initial)
+    {
+    }
+
+    async_semaphore(async_semaphore const&) = delete;
+    async_semaphore& operator=(async_semaphore const&) = delete;
+
+    [[nodiscard]] acquire_awaiter acquire() noexcept { return acquire_awaiter(*this); }
+
+    bool
+    try_acquire() noexcept
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return try_acquire_locked();
+    }
+
+    // Units go to the longest waiters first, then to the count
+    void
+    release(std::size_t n = 1) noexcept
+    {
+        detail::waiter_list ready;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            for(; n > 0 && !waiters_.empty(); --n)
+                waiters_.pop_front()->wake(ready);
+            count_ += n;
+        }
+        ready.post_all();
+    }
+};
+
+// Mutual exclusion between coroutines: a semaphore of one. unlock()
+// hands the mutex directly to the oldest waiter.
+class async_mutex
+{
+    async_semaphore sem_{1};
+
+public:
+    [[nodiscard]] auto lock() noexcept { return sem_.acquire(); }
+    bool try_lock() noexcept { return sem_.try_acquire(); }
+    void unlock() noexcept { sem_.release(); }
+};
+
+static_assert(IoAwaitable<decltype(std::declval<async_semaphore&>().acquire())>);
+
+// Bounded multi-producer, multi-consumer channel. The buffer is
+// allocated once, at construction; with a capacity of zero every
+// send waits for a receiver and hands its value over directly.
+// Values move straight into a waiting receiver's awaiter. After
+// close(), waiting and later senders fail with
+// std::errc::broken_pipe, and receivers drain the buffer before
+// failing the same way.
+template<class T>
+class channel
+{
+    class send_awaiter : public detail::waiting_awaiter<send_awaiter>
+    {
+        friend class detail::waiting_awaiter<send_awaiter>;
+        friend class channel;
+
+        channel* c_;
+        std::optional<T> value_;
+
+        std::mutex& owner_mutex() noexcept { return c_->mtx_; }
+        detail::waiter_list& waiters() noexcept { return c_->senders_; }
+        bool try_complete(detail::waiter_list& ready) { return c_->try_send_locked(*this, ready); }
+
+    public:
+        send_awaiter(channel& c, T&& v)
+            : c_(&c)
+            , value_(std::move(v))
+        {
+        }
+
+        send_awaiter(send_awaiter&& other)
+            : detail::waiting_awaiter<send_awaiter>(std::move(other))
+            , c_(other.c_)
+            , value_(std::move(other.value_))
+        {
+        }
+
+        std::error_code
+        await_resume() noexcept
+        {
+            this->finish();
+            return this->ec;
+        }
+    };
+
+    class receive_awaiter : public detail::waiting_awaiter<receive_awaiter>
+    {
+        friend class detail::waiting_awaiter<receive_awaiter>;
+        friend class channel;
+
+        channel* c_;
+        std::optional<T> value_;
+
+        std::mutex& owner_mutex() noexcept { return c_->mtx_; }
+        detail::waiter_list& waiters() noexcept { return c_->receivers_; }
+        bool try_complete(detail::waiter_list& ready) { return c_->try_receive_locked(*this, ready); }
+
+    public:
+        explicit
+        receive_awaiter(channel& c) noexcept
+            : c_(&c)
+        {
+        }
+
+        receive_awaiter(receive_awaiter&& other) noexcept
+            : detail::waiting_awaiter<receive_awaiter>(std::move(other))
+            , c_(other.c_)
+        {
+        }
+
+        // The value is empty exactly when ec is set
+        std::pair<std::error_code, std::optional<T>>
+        await_resume()
+        {
+            this->finish();
+            return {this->ec, std::move(value_)};
+        }
+    };
+
+    std::mutex mtx_;
+    std::unique_ptr<std::optional<T>[]> buf_;
+    std::size_t capacity_;
+    std::size_t head_ = 0;          // guarded by mtx_
+    std::size_t size_ = 0;          // guarded by mtx_
+    bool closed_ = false;           // guarded by mtx_
+    detail::waiter_list senders_;   // guarded by mtx_
+    detail::waiter_list receivers_; // guarded by mtx_
+
+    static std::error_code
+    closed_error() noexcept
+    {
+        return std::make_error_code(std::errc::broken_pipe);
+    }
+
+    void
+    push_locked(T&& v)
+    {
+        buf_[(head_ + size_) % capacity_].emplace(std::move(v));
+        ++size_;
+    }
+
+    T
+    pop_locked()
+    {
+        auto& slot = buf_[head_];
+        T v = std::move(*slot);
+        slot.reset();
+        head_ = (head_ + 1) % capacity_;
+        --size_;
+        return v;
+    }
+
+    bool
+    try_send_locked(send_awaiter& s, detail::waiter_list& ready)
+    {
+        if(closed_)
+        {
+            s.ec = closed_error();
+            return true;
+        }
+        if(!receivers_.empty())
+        {
+            auto* r = static_cast<receive_awaiter*>(receivers_.pop_front());
+            r->value_.emplace(std::move(*s.value_));
+            r->wake(ready);
+            return true;
+        }
+        if(size_ < capacity_)
+        {
+            push_locked(std::move(*s.value_));
+            return true;
+        }
+        return false;
+    }
+
+    bool
+    try_receive_locked(receive_awaiter& r, detail::waiter_list& ready)
+    {
+        if(size_ > 0)
+        {
+            r.value_.emplace(pop_locked());
+            // A waiting sender takes the freed slot
+            if(!senders_.empty())
+            {
+                auto* s = static_cast<send_awaiter*>(senders_.pop_front());
+                push_locked(std::move(*s->value_));
+                s->wake(ready);
+            }
+            return true;
+        }
+        if(!senders_.empty())
+        {
+            auto* s = static_cast<send_awaiter*>(senders_.pop_front());
+            r.value_.emplace(std::move(*s->value_));
+            s->wake(ready);
+            return true;
+        }
+        if(closed_)
+        {
+            r.ec = closed_error();
+            return true;
+        }
+        return false;
+    }
+
+public:
+    explicit
+    channel(std::size_t capacity)
+        : buf_(capacity ? new std::optional<T>[capacity] : nullptr)
+        , capacity_(capacity)
+    {
+    }
+
+    channel(channel const&) = delete;
+    channel& operator=(channel const&) = delete;
+
+    std::size_t capacity() const noexcept { return capacity_; }
+
+    [[nodiscard]] send_awaiter send(T v) { return send_awaiter(*this, std::move(v)); }
+    [[nodiscard]] receive_awaiter receive() noexcept { return receive_awaiter(*this); }
+
+    void
+    close() noexcept
+    {
+        detail::waiter_list ready;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            closed_ = true;
+            while(!senders_.empty())
+                senders_.pop_front()->wake(ready, closed_error());
+            while(!receivers_.empty())
+                receivers_.pop_front()->wake(ready, closed_error());
+        }
+        ready.post_all();
+    }
+};
+
+static_assert(IoAwaitable<decltype(std::declval<channel<int>&>().send(0))>);
+static_assert(IoAwaitable<decltype(std::declval<channel<int>&>().receive())>);
+
+// ============================================================
+// timer_service - hierarchical timing wheel
+// ============================================================
+
+namespace detail {
+
+// Wheel entry, embedded in the awaiter so scheduling allocates
+// nothing. Linked into exactly one slot while pending.
+struct timer_node
+{
+    timer_node* prev = nullptr;
+    timer_node* next = nullptr;
+    std::uint64_t expiry = 0;       // tick at which the node is due
+    std::uint8_t level = 0;
+    std::uint8_t slot = 0;
+    bool linked = false;
+    void (*fire)(timer_node*) noexcept = nullptr;
+};
+
+// Hierarchical timing wheel with 64 slots per level. Level L holds
+// nodes due within 64^(L+1) ticks, and a level's slot is cascaded
+// into the levels below when the lower levels wrap around to it.
+// Insertion and removal are O(1); advancing costs O(1) per tick plus
+// the nodes cascaded or fired.
+class timing_wheel
+{
+    static constexpr unsigned slot_bits = 6;
+    static constexpr unsigned slots = 1u << slot_bits;
+    static constexpr unsigned levels = 5;
+    static constexpr std::uint64_t range =
+        std::uint64_t(1) << (slot_bits * levels);
+
+    timer_node* slots_[levels][slots] = {};
+    std::uint64_t occupied_[levels] = {};   // bit per non-empty slot
+    std::uint64_t base_ = 0;                // next tick to process
+    std::size_t size_ = 0;
+
+    void
+    place(timer_node* n) noexcept
+    {
+        std::uint64_t e = std::max(n->expiry, base_);
+        // Beyond the wheel's range, park in the top level. The node
+        // keeps its real expiry and is placed again when cascaded.
+        if(e - base_ >= range)
+            e = base_ + range - 1;
+        std::uint64_t delta = e - base_;
+        unsigned level = 0;
+        while(delta >= (std::uint64_t(1) << (slot_bits * (level + 1))))
+            ++level;
+        unsigned slot = (e >> (slot_bits * level)) & (slots - 1);
+        n->level = static_cast<std::uint8_t>(level);
+        n->slot = static_cast<std::uint8_t>(slot);
+        n->prev = nullptr;
+        n->next = slots_[level][slot];
+        if(n->next)
+            n->next->prev = n;
+        slots_[level][slot] = n;
+        occupied_[level] |= std::uint64_t(1) << slot;
+    }
+
+    void
+    cascade(unsigned level, unsigned slot) noexcept
+    {
+        timer_node* n = std::exchange(slots_[level][slot], nullptr);
+        occupied_[level] &= ~(std::uint64_t(1) << slot);
+        while(n)
+        {
+            timer_node* next = n->next;
+            place(n);
+            n = next;
+        }
+    }
+
+public:
+    bool empty() const noexcept { return size_ == 0; }
+
+    void
+    insert(timer_node* n) noexcept
+    {
+        place(n);
+        n->linked = true;
+        ++size_;
+    }
+
+    void
+    remove(timer_node* n) noexcept
+    {
+        if(n->prev)
+            n->prev->next = n->next;
+        else if(!(slots_[n->level][n->slot] = n->next))
+            occupied_[n->level] &= ~(std::uint64_t(1) << n->slot);
+        if(n->next)
+            n->next->prev = n->prev;
+        n->linked = false;
+        --size_;
+    }
+
+    // Earliest tick at which advance() has work to do: base_ itself
+    // when it is a wrap point still to cascade, then the next
+    // occupied slot of the lowest level, or else the next time it
+    // wraps and cascades. Empty wheels return UINT64_MAX.
+    std::uint64_t
+    next_due() const noexcept
+    {
+        if(size_ == 0)
+            return UINT64_MAX;
+        unsigned idx = base_ & (slots - 1);
+        if(idx == 0)
+            for(unsigned level = 1; level < levels; ++level)
+                if(occupied_[level])
+                    return base_;
+        if(std::uint64_t m = occupied_[0] >> idx)
+            return base_ + std::countr_zero(m);
+        return (base_ | (slots - 1)) + 1;
+    }
+
+    // Process every tick up to and including now. Due nodes are
+    // unlinked and returned as a list chained through next.
+    timer_node*
+    advance(std::uint64_t now) noexcept
+    {
+        timer_node* due = nullptr;
+        while(base_ <= now)
+        {
+            if(size_ == 0)
+            {
+                base_ = now + 1;
+                break;
+            }
+            unsigned idx = base_ & (slots - 1);
+            if(idx == 0)
+            {
+                for(unsigned level = 1; level < levels; ++level)
+                {
+                    unsigned s = (base_ >> (slot_bits * level)) & (slots - 1);
+                    cascade(level, s);
+                    if(s != 0)
+                        break;
+                }
+            }
+            else if(occupied_[0] >> idx == 0)
+            {
+                // Nothing until the lowest level wraps
+                base_ = std::min((base_ | (slots - 1)) + 1, now + 1);
+                continue;
+            }
+            timer_node* n = std::exchange(slots_[0][idx], nullptr);
+            occupied_[0] &= ~(std::uint64_t(1) << idx);
+            while(n)
+            {
+                timer_node* next = n->next;
+                n->linked = false;
+                n->next = due;
+                due = n;
+                --size_;
+                n = next;
+            }
+            ++base_;
+        }
+        return due;
+    }
+};
+
+class sleep_op;
+
+} // namespace detail
+
+// Per-context timers. A timer thread, started on first use, advances
+// the wheel at millisecond resolution and posts each expired waiter
+// to the executor it awaited from. The thread sleeps until the next
+// occupied slot, waking at least every 64 ms only while timers beyond
+// the lowest level are pending. Sleeps still pending at shutdown are
+// abandoned.
+class timer_service : public execution_context::service
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using tick = std::chrono::milliseconds;
+
+private:
+    friend class detail::sleep_op;
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    detail::timing_wheel wheel_;
+    clock::time_point epoch_ = clock::now();
+    std::thread thread_;
+    bool stopped_ = false;
+
+    std::uint64_t
+    due_tick(clock::time_point t) const noexcept
+    {
+        if(t <= epoch_)
+            return 0;
+        // Round up so a timer never fires early
+        return static_cast<std::uint64_t>(
+            std::chrono::ceil<tick>(t - epoch_).count());
+    }
+
+    std::uint64_t
+    now_tick() const noexcept
+    {
+        return static_cast<std::uint64_t>(
+            std::chrono::floor<tick>(clock::now() - epoch_).count());
+    }
+
+    void
+    run()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        while(!stopped_)
+        {
+            std::uint64_t next = wheel_.next_due();
+            if(next == UINT64_MAX)
+            {
+                cv_.wait(lock);
+                continue;
+            }
+            std::uint64_t now = now_tick();
+            if(now < next)
+            {
+                cv_.wait_until(lock, epoch_ + tick(next));
+                continue;
+            }
+            detail::timer_node* due = wheel_.advance(now);
+            lock.unlock();
+            while(due)
+            {
+                // Firing may destroy the node
+                detail::timer_node* n = due;
+                due = due->next;
+                n->fire(n);
+            }
+            lock.lock();
+        }
+    }
+
+    // Link n unless a stop request already claimed it. Returns false
+    // if n was not scheduled.
+    bool
+    schedule(detail::timer_node* n, clock::time_point deadline, bool& cancelled)
+    {
+        n->expiry = due_tick(deadline);
+        std::lock_guard<std::mutex> lock(mtx_);
+        if(cancelled)
+            return false;
+        bool earlier = n->expiry < wheel_.next_due();
+        wheel_.insert(n);
+        if(!thread_.joinable())
+            thread_ = std::thread([this]{ run(); });
+        else if(earlier)
+            cv_.notify_one();
+        return true;
+    }
+
+    // Unlink n if it is still pending. Returns true if it was.
+    bool
+    cancel(detail::timer_node* n, bool& cancelled) noexcept
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        cancelled = true;
+        if(!n->linked)
+            return false;
+        wheel_.remove(n);
+        return true;
+    }
+
+protected:
+    void
+    shutdown() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stopped_ = true;
+        }
+        cv_.notify_one();
+        if(thread_.joinable())
+            thread_.join();
+    }
+
+public:
+    explicit
+    timer_service(execution_context&)
+    {
+    }
+
+    ~timer_service()
+    {
+        shutdown();
+    }
+};
+
+namespace detail {
+
+// Awaiter of async_sleep_until. Completes with an empty error_code
+// when the deadline passes, or with operation_canceled when the
+// environment's stop token is triggered first; the stop callback
+// unlinks the node in O(1).
+class sleep_op : timer_node
+{
+    struct on_stop
+    {
+        sleep_op* self;
+
+        void operator()() const noexcept
+        {
+            if(self->svc_->cancel(self, self->cancelled_))
+                self->complete(std::make_error_code(std::errc::operation_canceled));
+        }
+    };
+
+    timer_service::clock::time_point deadline_;
+    timer_service* svc_ = nullptr;
+    std::coroutine_handle<> h_;
+    executor_ref ex_;
+    std::error_code ec_;
+    bool cancelled_ = false;    // guarded by the service mutex
+    bool scheduled_ = false;
+    std::optional<inplace_stop_callback<on_stop>> stop_cb_;
+#if CAPY_TRACING
+    bool traced_ = false;
+    trace_clock::time_point ready_{};
+#endif
+
+    static void
+    on_fire(timer_node* n) noexcept
+    {
+        auto* self = static_cast<sleep_op*>(n);
+        // Waits out a stop callback running on another thread
+        self->stop_cb_.reset();
+        self->complete({});
+    }
+
+    // The awaiter, and the executor ex_ refers to, may be destroyed
+    // as soon as h_ is posted. The posted handle keeps the context
+    // running until await_resume finishes the work.
+    void
+    complete(std::error_code ec) noexcept
+    {
+        ec_ = ec;
+#if CAPY_TRACING
+        if(traced_)
+            ready_ = trace_clock::now();
+#endif
+        ex_.post(h_);
+    }
+
+public:
+    explicit
+    sleep_op(timer_service::clock::time_point deadline) noexcept
+        : deadline_(deadline)
+    {
+        fire = &on_fire;
+    }
+
+    // Moved only before the operation starts
+    sleep_op(sleep_op&& other) noexcept
+        : sleep_op(other.deadline_)
+    {
+    }
+
+    bool
+    await_ready() const noexcept
+    {
+        return deadline_ <= timer_service::clock::now();
+    }
+
+    bool
+    await_suspend(std::coroutine_handle<> h, io_env const* env)
+    {
+        if(env->stop_token.stop_requested())
+        {
+            ec_ = std::make_error_code(std::errc::operation_canceled);
+            return false;
+        }
+        h_ = h;
+        ex_ = env->executor;
+#if CAPY_TRACING
+        traced_ = env->tracer != nullptr;
+#endif
+        svc_ = &ex_.context().use_service<timer_service>();
+        // Installed before scheduling so on_fire never races it
+        if(env->stop_token.stop_possible())
+            stop_cb_.emplace(env->stop_token, on_stop{this});
+        ex_.on_work_started();
+        scheduled_ = true;
+        if(svc_->schedule(this, deadline_, cancelled_))
+            return true;
+        scheduled_ = false;
+        ex_.on_work_finished();
+        ec_ = std::make_error_code(std::errc::operation_canceled);
+        return false;
+    }
+
+    std::error_code
+    await_resume() noexcept
+    {
+        if(scheduled_)
+            ex_.on_work_finished();
+        return ec_;
+    }
+
+#if CAPY_TRACING
+    trace_clock::time_point trace_ready_time() const noexcept { return ready_; }
+#endif
+};
+
+} // namespace detail
+
+inline detail::sleep_op
+async_sleep_until(timer_service::clock::time_point deadline) noexcept
+{
+    return detail::sleep_op(deadline);
+}
+
+template<class Rep, class Period>
+detail::sleep_op
+async_sleep_for(std::chrono::duration<Rep, Period> d) noexcept
+{
+    return detail::sleep_op(timer_service::clock::now() +
+        std::chrono::ceil<timer_service::clock::duration>(d));
+}
+
+static_assert(IoAwaitable<detail::sleep_op>);
+
+// ============================================================
+// buffer_pool - kernel-selected receive buffers
+// ============================================================
+
+#if CAPY_HAS_IO_URING
+
+// A provided buffer ring registered with an io_context's io_uring.
+// Reads that draw from the pool leave buffer choice to the kernel,
+// which picks one only once data has arrived, so idle connections
+// hold no receive buffer at all. Buffers are handed out as
+// pooled_buffer views and return to the ring when the view is
+// destroyed, from any thread. The pool must be destroyed before its
+// io_context.
+class buffer_pool
+{
+    io_context* ctx_;
+    io_uring_buf* ring_ = nullptr;
+    std::byte* storage_ = nullptr;
+    std::size_t ring_len_;
+    std::size_t storage_len_;
+    std::size_t buffer_size_;
+    unsigned mask_;
+    unsigned short group_;
+    unsigned short tail_ = 0;   // guarded by mtx_
+    std::mutex mtx_;
+
+    static void*
+    map(std::size_t n)
+    {
+        void* p = ::mmap(nullptr, n, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(), "mmap");
+        return p;
+    }
+
+    // Append buffer bid to the ring. The tail shares storage with the
+    // first entry's reserved field, so entries are written field by
+    // field and published with a release store of the tail.
+    void
+    push_locked(unsigned short bid) noexcept
+    {
+        io_uring_buf& b = ring_[tail_ & mask_];
+        b.addr = reinterpret_cast<std::uint64_t>(storage_ + bid * buffer_size_);
+        b.len = static_cast<std::uint32_t>(buffer_size_);
+        b.bid = bid;
+        ++tail_;
+    }
+
+    void
+    publish_locked() noexcept
+    {
+        std::atomic_ref<unsigned short>(ring_[0].resv).store(tail_,
+            std::memory_order_release);
+    }
+
+public:
+    // count must be a power of two no larger than 32768
+    buffer_pool(io_context& ctx, unsigned count, std::size_t buffer_size,
+        unsigned short group = 0)
+        : ctx_(&ctx)
+        , ring_len_(count * sizeof(io_uring_buf))
+        , storage_len_(count * buffer_size)
+        , buffer_size_(buffer_size)
+        , mask_(count - 1)
+        , group_(group)
+    {
+        if(count == 0 || count > 32768 || (count & mask_) != 0 ||
+            buffer_size == 0 || buffer_size > UINT32_MAX)
+            throw std::system_error(
+                std::make_error_code(std::errc::invalid_argument),
+                "buffer_pool");
+        ring_ = static_cast<io_uring_buf*>(map(ring_len_));
+        try
+        {
+            // Pages are backed lazily, so untouched buffers cost no RSS
+            storage_ = static_cast<std::byte*>(map(storage_len_));
+            for(unsigned i = 0; i < count; ++i)
+                push_locked(static_cast<unsigned short>(i));
+            publish_locked();
+
+            io_uring_buf_reg reg{};
+            reg.ring_addr = reinterpret_cast<std::uint64_t>(ring_);
+            reg.ring_entries = count;
+            reg.bgid = group_;
+            ctx_->ring().register_resource(IORING_REGISTER_PBUF_RING, &reg, 1);
+        }
+        catch(...)
+        {
+            if(storage_)
+                ::munmap(storage_, storage_len_);
+            ::munmap(ring_, ring_len_);
+            throw;
+        }
+    }
+
+    buffer_pool(buffer_pool const&) = delete;
+    buffer_pool& operator=(buffer_pool const&) = delete;
+
+    // Never creates a ring just to unregister from it
+    ~buffer_pool()
+    {
+        if(auto* ring = ctx_->existing_ring())
+        {
+            io_uring_buf_reg reg{};
+            reg.bgid = group_;
+            ring->unregister_resource(IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        }
+        ::munmap(storage_, storage_len_);
+        ::munmap(ring_, ring_len_);
+    }
+
+    io_context& context() const noexcept { return *ctx_; }
+    std::size_t buffer_size() const noexcept { return buffer_size_; }
+    unsigned short group() const noexcept { return group_; }
+
+    std::byte*
+    data(unsigned short bid) const noexcept
+    {
+        return storage_ + bid * buffer_size_;
+    }
+
+    // Return a buffer to the kernel
+    void
+    recycle(unsigned short bid) noexcept
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        push_locked(bid);
+        publish_locked();
+    }
+};
+
+// A received buffer borrowed from a buffer_pool
+class pooled_buffer
+{
+    buffer_pool* pool_ = nullptr;
+    unsigned short bid_ = 0;
+    std::size_t size_ = 0;
+
+public:
+    pooled_buffer() = default;
+
+    pooled_buffer(buffer_pool& pool, unsigned short bid, std::size_t size) noexcept
+        : pool_(&pool)
+        , bid_(bid)
+        , size_(size)
+    {
+    }
+
+    pooled_buffer(pooled_buffer&& other) noexcept
+        : pool_(std::exchange(other.pool_, nullptr))
+        , bid_(other.bid_)
+        , size_(std::exchange(other.size_, 0))
+    {
+    }
+
+    pooled_buffer&
+    operator=(pooled_buffer&& other) noexcept
+    {
+        if(this != &other)
+        {
+            reset();
+            pool_ = std::exchange(other.pool_, nullptr);
+            bid_ = other.bid_;
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+
+    ~pooled_buffer()
+    {
+        reset();
+    }
+
+    // Give the buffer back to the pool early
+    void
+    reset() noexcept
+    {
+        if(pool_)
+            std::exchange(pool_, nullptr)->recycle(bid_);
+        size_ = 0;
+    }
+
+    std::span<std::byte const>
+    bytes() const noexcept
+    {
+        if(!pool_)
+            return {};
+        return {pool_->data(bid_), size_};
+    }
+
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+};
+
+namespace detail {
+
+template<IoAwaitable A>
+class with_buffers_awaiter
+{
+    A inner_;
+    buffer_pool* pool_;
+    io_env env_;
+
+public:
+    with_buffers_awaiter(buffer_pool& pool, A&& inner)
+        : inner_(std::move(inner))
+        , pool_(&pool)
+    {
+    }
+
+    static constexpr bool resumes_in_environment =
+        detail::resumes_in_environment<A>;
+
+    bool await_ready() { return inner_.await_ready(); }
+
+    decltype(auto)
+    await_suspend(std::coroutine_handle<> h, io_env const* env)
+    {
+        env_ = *env;
+        env_.buffers = pool_;
+        return inner_.await_suspend(h, &env_);
+    }
+
+    decltype(auto) await_resume() { return inner_.await_resume(); }
+};
+
+} // namespace detail
+
+// Await a, making pool the io_env::buffers seen by it and by
+// everything it awaits in turn
+template<IoAwaitable A>
+auto
+with_buffers(buffer_pool& pool, A a)
+{
+    return detail::with_buffers_awaiter<A>(pool, std::move(a));
+}
+
+#endif // CAPY_HAS_IO_URING
+
+// ============================================================
+// socket - io_uring backed stream socket
+// ============================================================
+
+// Result of an I/O operation
+template<class T>
+struct io_result
+{
+    std::error_code ec;
+    T value{};
+};
+
+#if CAPY_HAS_IO_URING
+
+class socket;
+
+namespace detail {
+
+// Base of the socket awaitables. The awaiter lives in the awaiting
+// coroutine's frame and doubles as the uring operation, so nothing
+// is allocated per operation. Operations must be started on the
+// thread running the socket's io_context; the awaiting coroutine is
+// resumed through its own io_env::executor.
+//
+// While pending, the awaiter also holds a stop callback on the
+// environment's stop token. A stop request asks the loop to submit
+// IORING_OP_ASYNC_CANCEL, and the operation completes with
+// std::errc::operation_canceled. A token already stopped at start
+// completes the operation without suspending.
+class socket_op : public cancellable_op
+{
+    struct on_stop
+    {
+        socket_op* self;
+
+        void operator()() const noexcept
+        {
+            self->ctx_->request_cancel(self);
         }
-        else if constexpr (std::is_same_v<Tag, this_coro::stop_token_tag>)
+    };
+
+    std::optional<inplace_stop_callback<on_stop>> stop_cb_;
+#if CAPY_TRACING
+    trace_clock::time_point ready_{};
+#endif
+
+protected:
+    io_context* ctx_;
+    int fd_;
+    int res_ = 0;
+    unsigned flags_ = 0;
+    std::coroutine_handle<> h_;
+    io_env const* env_ = nullptr;
+
+    socket_op(io_context& ctx, int fd) noexcept
+        : cancellable_op{{&on_complete}}
+        , ctx_(&ctx)
+        , fd_(fd)
+    {
+    }
+
+    // Moved only before the operation starts
+    socket_op(socket_op&& other) noexcept
+        : cancellable_op{{other.complete}}
+        , ctx_(other.ctx_)
+        , fd_(other.fd_)
+    {
+    }
+
+    // The awaiter may be destroyed as soon as h_ is posted, when the
+    // awaiting coroutine resumes on another executor's thread, so
+    // nothing of it is touched after the post
+    static void
+    on_complete(uring_op* op, int res, unsigned flags) noexcept
+    {
+        auto* self = static_cast<socket_op*>(op);
+        io_context* ctx = self->ctx_;
+        self->res_ = res;
+        self->flags_ = flags;
+        if(self->stop_cb_)
+        {
+            // Waits out a callback running on another thread
+            self->stop_cb_.reset();
+            self->ctx_->withdraw_cancel(self);
+        }
+#if CAPY_TRACING
+        if(self->env_->tracer)
+            self->ready_ = trace_clock::now();
+#endif
+        self->env_->executor.post(self->h_);
+        ctx->get_executor().on_work_finished();
+    }
+
+    // Fill in an SQE through prep and queue it. Returns false, having
+    // set the result, if the operation is cancelled before starting.
+    template<class Prep>
+    bool
+    start(std::coroutine_handle<> h, io_env const* env, Prep prep)
+    {
+        if(env->stop_token.stop_requested())
+        {
+            res_ = -ECANCELED;
+            return false;
+        }
+        h_ = h;
+        env_ = env;
+        auto& ring = ctx_->ring();
+        io_uring_sqe* sqe = ring.get_sqe();
+        prep(*sqe);
+        sqe->fd = fd_;
+        sqe->user_data = reinterpret_cast<std::uint64_t>(
+            static_cast<uring_op*>(this));
+        // Submitted with the rest of the turn's SQEs
+        ctx_->get_executor().on_work_started();
+        if(env->stop_token.stop_possible())
+            stop_cb_.emplace(env->stop_token, on_stop{this});
+        return true;
+    }
+
+    std::error_code
+    error() const noexcept
+    {
+        if(res_ < 0)
+            return {-res_, std::system_category()};
+        return {};
+    }
+
+public:
+    bool await_ready() const noexcept { return false; }
+
+#if CAPY_TRACING
+    trace_clock::time_point trace_ready_time() const noexcept { return ready_; }
+#endif
+};
+
+class read_some_op : public socket_op
+{
+    std::span<std::byte> buf_;
+
+public:
+    read_some_op(io_context& ctx, int fd, std::span<std::byte> buf) noexcept
+        : socket_op(ctx, fd)
+        , buf_(buf)
+    {
+    }
+
+    bool
+    await_suspend(std::coroutine_handle<> h, io_env const* env)
+    {
+        return start(h, env, [this](io_uring_sqe& sqe) {
+            sqe.opcode = IORING_OP_RECV;
+            sqe.addr = reinterpret_cast<std::uint64_t>(buf_.data());
+            sqe.len = static_cast<std::uint32_t>(buf_.size());
+        });
+    }
+
+    io_result<std::size_t>
+    await_resume() const noexcept
+    {
+        return {error(), res_ < 0 ? 0 : static_cast<std::size_t>(res_)};
+    }
+};
+
+// Reads into whichever buffer the kernel picks from the awaiting
+// coroutine's io_env::buffers. Completes with no_buffer_space when
+// the environment has no pool or the pool is exhausted.
+class read_pooled_op : public socket_op
+{
+    buffer_pool* pool_ = nullptr;
+
+public:
+    read_pooled_op(io_context& ctx, int fd) noexcept
+        : socket_op(ctx, fd)
+    {
+    }
+
+    bool
+    await_suspend(std::coroutine_handle<> h, io_env const* env)
+    {
+        pool_ = env->buffers;
+        if(!pool_)
+        {
+            res_ = -ENOBUFS;
+            return false;
+        }
+        assert(&pool_->context() == ctx_);
+        return start(h, env, [this](io_uring_sqe& sqe) {
+            sqe.opcode = IORING_OP_RECV;
+            sqe.len = static_cast<std::uint32_t>(pool_->buffer_size());
+            sqe.flags = IOSQE_BUFFER_SELECT;
+            sqe.buf_group = pool_->group();
+        });
+    }
+
+    io_result<pooled_buffer>
+    await_resume() const noexcept
+    {
+        io_result<pooled_buffer> r{error(), {}};
+        // A buffer is consumed even by a zero-length read
+        if(flags_ & IORING_CQE_F_BUFFER)
+            r.value = pooled_buffer(*pool_,
+                static_cast<unsigned short>(flags_ >> IORING_CQE_BUFFER_SHIFT),
+                res_ < 0 ? 0 : static_cast<std::size_t>(res_));
+        return r;
+    }
+};
+
+class write_some_op : public socket_op
+{
+    std::span<std::byte const> buf_;
+
+public:
+    write_some_op(io_context& ctx, int fd, std::span<std::byte const> buf) noexcept
+        : socket_op(ctx, fd)
+        , buf_(buf)
+    {
+    }
+
+    bool
+    await_suspend(std::coroutine_handle<> h, io_env const* env)
+    {
+        return start(h, env, [this](io_uring_sqe& sqe) {
+            sqe.opcode = IORING_OP_SEND;
+            sqe.addr = reinterpret_cast<std::uint64_t>(buf_.data());
+            sqe.len = static_cast<std::uint32_t>(buf_.size());
+            sqe.msg_flags = MSG_NOSIGNAL;
+        });
+    }
+
+    io_result<std::size_t>
+    await_resume() const noexcept
+    {
+        return {error(), res_ < 0 ? 0 : static_cast<std::size_t>(res_)};
+    }
+};
+
+class accept_op : public socket_op
+{
+public:
+    accept_op(io_context& ctx, int fd) noexcept
+        : socket_op(ctx, fd)
+    {
+    }
+
+    bool
+    await_suspend(std::coroutine_handle<> h, io_env const* env)
+    {
+        return start(h, env, [](io_uring_sqe& sqe) {
+            sqe.opcode = IORING_OP_ACCEPT;
+            sqe.accept_flags = SOCK_CLOEXEC;
+        });
+    }
+
+    io_result<socket> await_resume() const noexcept;
+};
+
+} // namespace detail
+
+class socket
+{
+    io_context* ctx_ = nullptr;
+    int fd_ = -1;
+
+public:
+    socket() = default;
+
+    // Adopts fd, which is closed by the destructor
+    socket(io_context& ctx, int fd) noexcept
+        : ctx_(&ctx)
+        , fd_(fd)
+    {
+    }
+
+    socket(socket&& other) noexcept
+        : ctx_(other.ctx_)
+        , fd_(std::exchange(other.fd_, -1))
+    {
+    }
+
+    socket&
+    operator=(socket&& other) noexcept
+    {
+        if(this != &other)
+        {
+            close();
+            ctx_ = other.ctx_;
+            fd_ = std::exchange(other.fd_, -1);
+        }
+        return *this;
+    }
+
+    ~socket()
+    {
+        close();
+    }
+
+    bool is_open() const noexcept { return fd_ >= 0; }
+    int native_handle() const noexcept { return fd_; }
+    io_context& context() const noexcept { return *ctx_; }
+
+    void
+    close() noexcept
+    {
+        if(fd_ >= 0)
+            ::close(std::exchange(fd_, -1));
+    }
+
+    detail::read_some_op
+    async_read_some(std::span<std::byte> buf) noexcept
+    {
+        return {*ctx_, fd_, buf};
+    }
+
+    // Read into a buffer from the awaiting coroutine's buffer_pool
+    detail::read_pooled_op
+    async_read_some() noexcept
+    {
+        return {*ctx_, fd_};
+    }
+
+    detail::write_some_op
+    async_write_some(std::span<std::byte const> buf) noexcept
+    {
+        return {*ctx_, fd_, buf};
+    }
+
+    // Accept a connection on a listening socket
+    detail::accept_op
+    async_accept() noexcept
+    {
+        return {*ctx_, fd_};
+    }
+};
+
+inline io_result<socket>
+detail::accept_op::await_resume() const noexcept
+{
+    if(res_ < 0)
+        return {error(), {}};
+    return {{}, socket(*ctx_, res_)};
+}
+
+static_assert(IoAwaitable<detail::read_some_op>);
+static_assert(IoAwaitable<detail::read_pooled_op>);
+static_assert(IoAwaitable<detail::write_some_op>);
+static_assert(IoAwaitable<detail::accept_op>);
+
+// A listening TCP socket bound to port on every IPv4 address. With
+// reuse_port, independent sockets may bind the same port and the
+// kernel spreads incoming connections across them, so each
+// io_context can accept on its own socket.
+inline socket
+listen_tcp(io_context& ctx, std::uint16_t port, bool reuse_port = false,
+    int backlog = SOMAXCONN)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        throw std::system_error(errno, std::system_category(), "socket");
+    socket s(ctx, fd);
+    int one = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(reuse_port && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        throw std::system_error(errno, std::system_category(), "SO_REUSEPORT");
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+        throw std::system_error(errno, std::system_category(), "bind");
+    if(::listen(fd, backlog) < 0)
+        throw std::system_error(errno, std::system_category(), "listen");
+    return s;
+}
+
+#endif // CAPY_HAS_IO_URING
+
+// ============================================================
+// Minimal run_sync — synchronous launcher for demonstration
+// ============================================================
+
+namespace detail {
+
+// Restores the thread's frame allocator on scope exit
+class frame_allocator_scope
+{
+    std::pmr::memory_resource* saved_;
+
+public:
+    explicit
+    frame_allocator_scope(std::pmr::memory_resource* mr) noexcept
+        : saved_(std::exchange(current_frame_allocator(), mr))
+    {
+    }
+
+    frame_allocator_scope(frame_allocator_scope const&) = delete;
+    frame_allocator_scope& operator=(frame_allocator_scope const&) = delete;
+
+    ~frame_allocator_scope()
+    {
+        current_frame_allocator() = saved_;
+    }
+};
+
+// The task must complete before h.resume() returns. Nothing here
+// drives a run loop, so the executor has to run posted work inline
+// and every awaited operation has to finish synchronously.
+template<IoRunnable Task>
+auto run_sync_in(io_env const& env, Task t)
+{
+    auto h = t.handle();
+    auto& p = h.promise();
+    p.set_environment(&env);
+    // No continuation — cont_ defaults to noop_coroutine()
+    t.release();
+    {
+        // Starting the task installs env.allocator as the thread's
+        // frame allocator; the caller's is back once run_sync returns
+        frame_allocator_scope scope(current_frame_allocator());
+        h.resume();
+    }
+
+    // A suspended task still has its handle held by an operation,
+    // so its frame must not be freed here
+    assert(h.done() && "run_sync requires an inline executor");
+
+    // The task has completed; free its frame once the result is out
+    struct frame_guard
+    {
+        std::coroutine_handle<> h;
+        ~frame_guard() { h.destroy(); }
+    } guard{h};
+
+    if(p.exception())
+        std::rethrow_exception(p.exception());
+
+    if constexpr (!std::is_void_v<decltype(t.await_resume())>)
+        return p.result();
+}
+
+} // namespace detail
+
+// Run t to completion on the calling thread. ex must resume posted
+// handles inline, as inline_executor does; a task on a context with
+// a run loop is started with co_spawn or spawn instead.
+template<IoRunnable Task>
+auto run_sync(executor_ref ex, std::stop_token token, Task t)
+{
+    detail::stop_bridge stop(token);
+    io_env env{ex, stop.get_token(), ex.context().get_frame_allocator()};
+#if CAPY_TRACING
+    env.tracer = ex.context().tracer();
+#endif
+    return detail::run_sync_in(env, std::move(t));
+}
+
+template<IoRunnable Task>
+auto run_sync(executor_ref ex, Task t)
+{
+    return run_sync(ex, std::stop_token{}, std::move(t));
+}
+
+// Invoke factory with mr as the thread's frame allocator, so the
+// root frame and every descendant come from mr, then run the task
+// with mr as io_env::allocator.
+template<class Factory>
+    requires IoRunnable<std::invoke_result_t<Factory&>>
+auto run_sync(executor_ref ex, std::stop_token token,
+    std::pmr::memory_resource* mr, Factory factory)
+{
+    detail::frame_allocator_scope scope(mr);
+    detail::stop_bridge stop(token);
+    io_env env{ex, stop.get_token(), mr};
+#if CAPY_TRACING
+    env.tracer = ex.context().tracer();
+#endif
+    return detail::run_sync_in(env, factory());
+}
+
+// As above with every frame in arena, which is reset once the root
+// task has completed and its result has been taken
+template<class Factory>
+    requires IoRunnable<std::invoke_result_t<Factory&>>
+auto run_sync(executor_ref ex, std::stop_token token,
+    request_arena& arena, Factory factory)
+{
+    struct reset_guard
+    {
+        request_arena& arena;
+        ~reset_guard() { arena.reset(); }
+    } guard{arena};
+    return run_sync(ex, token, &arena, std::move(factory));
+}
+
+// ============================================================
+// co_spawn - detached launcher
+// ============================================================
+
+namespace detail {
+
+// Owns a detached task's environment. Allocated from the task's
+// memory resource and freed, with the frame, when the task ends.
+template<class Ex, class Task>
+struct spawn_state : task_completion
+{
+    Ex ex;
+    std::pmr::memory_resource* mr;
+    io_env env;
+    std::coroutine_handle<typename Task::promise_type> h;
+    request_arena* reset = nullptr;     // reset when the task ends
+
+    spawn_state(Ex const& e, std::pmr::memory_resource* m, Task& t) noexcept
+        : task_completion{&on_complete}
+        , ex(e)
+        , mr(m)
+        , env{executor_ref(ex), inplace_stop_token{}, m}
+        , h(t.handle())
+    {
+#if CAPY_TRACING
+        env.tracer = ex.context().tracer();
+#endif
+        t.release();
+        h.promise().set_environment(&env);
+        h.promise().set_completion(this);
+    }
+
+    // Runs from the task's final suspend point, where destroying
+    // the frame is allowed
+    static std::coroutine_handle<>
+    on_complete(task_completion* c) noexcept
+    {
+        auto* self = static_cast<spawn_state*>(c);
+        if(auto ep = self->h.promise().exception())
+            self->ex.context().handle_exception(std::move(ep));
+        self->h.destroy();
+        Ex ex = self->ex;
+        auto* mr = self->mr;
+        auto* arena = self->reset;
+        self->~spawn_state();
+        mr->deallocate(self, sizeof(spawn_state), alignof(spawn_state));
+        if(arena)
+            arena->reset();
+        ex.on_work_finished();
+        return std::noop_coroutine();
+    }
+};
+
+} // namespace detail
+
+namespace detail {
+
+template<class Ex, class Factory>
+auto*
+spawn(Ex const& ex, std::pmr::memory_resource* mr, Factory& factory)
+{
+    using Task = std::invoke_result_t<Factory&>;
+    using state = spawn_state<Ex, Task>;
+
+    frame_allocator_scope scope(mr);
+    Task t = factory();
+    void* raw = mr->allocate(sizeof(state), alignof(state));
+    return ::new(raw) state(ex, mr, t);
+}
+
+} // namespace detail
+
+// Start the task made by factory on ex without waiting for it. As
+// with run_sync, the frames come from mr, which must outlive the
+// task. The context sees outstanding work until the task ends. An
+// exception escaping the task goes to the context's handler.
+template<Executor Ex, class Factory>
+    requires detail::is_task<std::invoke_result_t<Factory&>>::value
+void co_spawn(Ex const& ex, std::pmr::memory_resource* mr, Factory factory)
+{
+    auto* st = detail::spawn(ex, mr, factory);
+    ex.on_work_started();
+    ex.post(st->h);
+}
+
+// As above with every frame in arena, reset when the task ends.
+// The arena serves exactly one outstanding task: it must be empty
+// here, and it is not reused until the task has ended.
+template<Executor Ex, class Factory>
+    requires detail::is_task<std::invoke_result_t<Factory&>>::value
+void co_spawn(Ex const& ex, request_arena& arena, Factory factory)
+{
+    assert(arena.empty() && "request_arena already serves a task");
+    auto* st = detail::spawn(ex, &arena, factory);
+    st->reset = &arena;
+    ex.on_work_started();
+    ex.post(st->h);
+}
+
+// ============================================================
+// spawn - detached task without a control block
+// ============================================================
+
+namespace detail {
+
+// Executors that are all equal to their context's get_executor()
+template<class Ex>
+concept context_executor =
+    Executor<Ex> &&
+    ExecutionContext<std::remove_cvref_t<
+        decltype(std::declval<Ex const&>().context())>> &&
+    std::same_as<typename std::remove_cvref_t<
+        decltype(std::declval<Ex const&>().context())>::executor_type, Ex>;
+
+// One environment per context shared by every spawned task, so a
+// spawn allocates nothing beyond the task's own frame
+template<class Ctx>
+class spawn_env_service : public execution_context::service
+{
+    typename Ctx::executor_type ex_;
+    io_env env_;
+
+public:
+    explicit spawn_env_service(execution_context& ctx) noexcept
+        : ex_(static_cast<Ctx&>(ctx).get_executor())
+        , env_{executor_ref(ex_), inplace_stop_token{}, ctx.get_frame_allocator()}
+    {
+#if CAPY_TRACING
+        env_.tracer = ctx.tracer();
+#endif
+    }
+
+    io_env const* env() const noexcept { return &env_; }
+
+protected:
+    void shutdown() override {}
+};
+
+} // namespace detail
+
+// Start t on ex without waiting for it. The frame is destroyed at
+// its final suspend point and an escaping exception goes to the
+// context's handler. The task runs with no stop token, using the
+// frame allocator the context had when it first spawned.
+template<class Ex, class T, class FrameAllocator>
+    requires detail::context_executor<Ex>
+void spawn(Ex const& ex, task<T, FrameAllocator> t)
+{
+    using Ctx = std::remove_cvref_t<decltype(ex.context())>;
+    auto& svc = ex.context().template use_service<detail::spawn_env_service<Ctx>>();
+    auto h = t.handle();
+    t.release();
+    h.promise().set_environment(svc.env());
+    h.promise().set_detached();
+    ex.on_work_started();
+    ex.post(h);
+}
+
+// ============================================================
+// sharded_runtime - one io_context per core
+// ============================================================
+
+#if CAPY_HAS_IO_URING
+
+struct sharded_runtime_options
+{
+    // Number of shards, each an io_context on its own thread
+    std::size_t shards = std::thread::hardware_concurrency();
+
+    // Shard i is pinned to cpus[i % cpus.size()]. When empty, the
+    // shards take the system's CPUs in order.
+    std::vector<unsigned> cpus;
+
+    // Settings for every shard's context; its cpus are ignored
+    io_context_options context;
+};
+
+// Thread-per-core runtime. Each shard owns an io_context, its ring,
+// a stop source and the io_env of the tasks it runs, and its
+// thread is pinned, so it allocates frames from its own
+// thread-local pool on its own NUMA node. Shards share nothing.
+// Work moves between them only through an explicit post() or
+// run_on(executor(i), t). The exception is time: each context's
+// timer_service runs its own unpinned thread, started by the shard's
+// first sleep, which posts expired waiters back to the shard.
+//
+// A server opens one SO_REUSEPORT listener per shard and runs an
+// accept loop on each:
+//
+//     rt.spawn_each([](sharded_runtime& rt, std::size_t i) -> task<> {
+//         auto ln = listen_tcp(rt.context(i), 8080, true);
+//         for(;;)
+//         {
+//             auto [ec, s] = co_await ln.async_accept();
+//             ...
+//         }
+//     });
+//     rt.run();
+class sharded_runtime
+{
+    // Releases the shard's unit of work when stop is requested
+    struct release_work
+    {
+        io_context::executor_type ex;
+
+        void operator()() const noexcept
         {
-            struct awaiter
-            {
-                std::stop_token token_;
-                bool await_ready() const noexcept { return true; }
-                void await_suspend(std::coroutine_handle<>) const noexcept {}
-                std::stop_token await_resume() const noexcept { return token_; }
-            };
-            return awaiter{env_->stop_token};
+            ex.on_work_finished();
         }
-        else if constexpr (std::is_same_v<Tag, this_coro::allocator_tag>)
+    };
+
+    // Holds a unit of work from construction until request_stop(),
+    // so a shard with nothing to do keeps running for post()
+    struct shard
+    {
+        std::vector<unsigned> cpus;
+        io_context ctx;
+        io_context::executor_type ex;
+        inplace_stop_source stop;
+        io_env env;
+        std::optional<inplace_stop_callback<release_work>> keep;
+
+        explicit
+        shard(io_context_options opts)
+            : cpus(opts.cpus)
+            , ctx(std::move(opts))
+            , ex(ctx.get_executor())
+            , env{executor_ref(ex), stop.get_token(), ctx.get_frame_allocator()}
         {
-            struct awaiter
-            {
-                std::pmr::memory_resource* allocator_;
-                bool await_ready() const noexcept { return true; }
-                void await_suspend(std::coroutine_handle<>) const noexcept {}
-                std::pmr::memory_resource* await_resume() const noexcept { return allocator_; }
-            };
-            return awaiter{env_->allocator};
+            ex.on_work_started();
+            keep.emplace(stop.get_token(), release_work{ex});
         }
-        else
+    };
+
+    std::vector<std::unique_ptr<shard>> shards_;
+
+    // Called by run() on every shard's thread, once it is bound
+    std::vector<std::function<void(sharded_runtime&, std::size_t)>> starts_;
+
+    // Holds the shard's copy of the factory, which a coroutine
+    // lambda's task refers to until it ends
+    template<class Factory>
+    static task<>
+    start_on_shard(Factory f, sharded_runtime& rt, std::size_t i)
+    {
+        co_await f(rt, i);
+    }
+
+    void
+    run_shard(std::size_t i)
+    {
+        auto& s = *shards_[i];
+        detail::cpu_binding binding(s.cpus.data(), s.cpus.size());
+        for(auto& start : starts_)
+            start(*this, i);
+        s.ctx.run();
+    }
+
+public:
+    explicit
+    sharded_runtime(sharded_runtime_options opts = {})
+    {
+        auto n = opts.shards ? opts.shards : 1;
+        if(opts.cpus.empty())
+            opts.cpus = numa_topology::system().all_cpus();
+        shards_.reserve(n);
+        for(std::size_t i = 0; i < n; ++i)
         {
-            return static_cast<Derived*>(this)->transform_awaitable(
-                std::forward<T>(t));
+            auto o = opts.context;
+            o.cpus.clear();
+            if(!opts.cpus.empty())
+                o.cpus.push_back(opts.cpus[i % opts.cpus.size()]);
+            shards_.push_back(std::make_unique<shard>(std::move(o)));
         }
     }
+
+    sharded_runtime(sharded_runtime const&) = delete;
+    sharded_runtime& operator=(sharded_runtime const&) = delete;
+
+    std::size_t size() const noexcept { return shards_.size(); }
+    io_context& context(std::size_t i) noexcept { return shards_[i]->ctx; }
+    io_context::executor_type executor(std::size_t i) noexcept { return shards_[i]->ex; }
+
+    // Start t on shard i without waiting for it, like spawn(). It
+    // runs with the shard's stop token. Callable from any thread
+    // until request_stop(); this is the cross-shard hand-off.
+    template<class T, class FrameAllocator>
+    void
+    post(std::size_t i, task<T, FrameAllocator> t)
+    {
+        auto& s = *shards_[i];
+        auto h = t.handle();
+        t.release();
+        h.promise().set_environment(&s.env);
+        h.promise().set_detached();
+        s.ex.on_work_started();
+        s.ex.post(h);
+    }
+
+    // Run factory(*this, i) as a task on every shard i, once run()
+    // has started the shard's thread and bound it to its CPU. Each
+    // shard gets its own copy of factory, and every frame of the
+    // task is created on the shard's thread. Call before run().
+    template<class Factory>
+    void
+    spawn_each(Factory const& factory)
+    {
+        starts_.emplace_back([factory](sharded_runtime& rt, std::size_t i) {
+            rt.post(i, start_on_shard(factory, rt, i));
+        });
+    }
+
+    // Ask every shard's tasks to stop, through their io_env, and
+    // let each shard's run loop end once its work has drained
+    void
+    request_stop() noexcept
+    {
+        for(auto& s : shards_)
+            s->stop.request_stop();
+    }
+
+    // Run every shard, shard 0 on the calling thread, until
+    // request_stop() has been called and no shard has work left
+    void
+    run()
+    {
+        std::vector<std::thread> threads;
+        threads.reserve(size() - 1);
+#if CAPY_TRACING
+        for(auto& s : shards_)
+            s->env.tracer = s->ctx.tracer();
+#endif
+        for(std::size_t i = 1; i < size(); ++i)
+            threads.emplace_back([this, i] { run_shard(i); });
+        run_shard(0);
+        for(auto& t : threads)
+            t.join();
+        starts_.clear();
+    }
 };
 
+#endif // CAPY_HAS_IO_URING
+
 // ============================================================
-// task<T> — lazy coroutine task satisfying IoRunnable
+// Sender/receiver bridge
 // ============================================================
 
-namespace detail {
+// The slice of the P2300 protocol the bridge speaks, in the member
+// function form adopted by P2855: sndr.connect(rcvr), op.start(),
+// rcvr.set_value(vs...), rcvr.get_env() and env.query(tag).
+// Senders describe their completions with a completion_signatures
+// member type. Where the standard library ships std::execution
+// these would be aliases of its names.
+namespace execution {
 
-template<typename T>
-struct task_return_base
+struct sender_t {};
+struct receiver_t {};
+struct operation_state_t {};
+
+struct set_value_t {};
+struct set_error_t {};
+struct set_stopped_t {};
+
+template<class... Sigs>
+struct completion_signatures {};
+
+struct empty_env {};
+
+struct get_env_t
 {
-    std::optional<T> result_;
+    template<class T>
+    auto
+    operator()(T const& t) const noexcept
+    {
+        if constexpr (requires { t.get_env(); })
+            return t.get_env();
+        else
+            return empty_env{};
+    }
+};
 
-    void return_value(T value) { result_ = std::move(value); }
-    T&& result() noexcept { return std::move(*result_); }
+inline constexpr get_env_t get_env{};
+
+// An environment without a stop token never stops
+struct get_stop_token_t
+{
+    template<class Env>
+    auto
+    operator()(Env const& env) const noexcept
+    {
+        if constexpr (requires { env.query(*this); })
+            return env.query(*this);
+        else
+            return inplace_stop_token{};
+    }
+};
+
+inline constexpr get_stop_token_t get_stop_token{};
+
+struct get_allocator_t
+{
+    template<class Env>
+        requires requires(Env const& env, get_allocator_t const& q) { env.query(q); }
+    auto
+    operator()(Env const& env) const noexcept
+    {
+        return env.query(*this);
+    }
+};
+
+inline constexpr get_allocator_t get_allocator{};
+
+} // namespace execution
+
+namespace detail {
+
+template<class... Vs>
+struct value_pack
+{
+    using type = std::tuple<std::decay_t<Vs>...>;
 };
 
 template<>
-struct task_return_base<void>
+struct value_pack<>
 {
-    void return_void() {}
+    using type = void;
 };
 
-} // namespace detail
+template<class V>
+struct value_pack<V>
+{
+    using type = std::decay_t<V>;
+};
 
-template<typename T = void>
-struct [[nodiscard]] task
+template<class Sig>
+struct value_of
 {
-    struct promise_type
-        : io_awaitable_support<promise_type>
-        , detail::task_return_base<T>
+    static constexpr bool value = false;
+};
+
+template<class... Vs>
+struct value_of<execution::set_value_t(Vs...)>
+{
+    static constexpr bool value = true;
+    using type = typename value_pack<Vs...>::type;
+};
+
+// What co_await yields for a sender: nothing, its single value, or
+// a tuple of its values
+template<class Sigs>
+struct sender_value;
+
+template<class... Sigs>
+struct sender_value<execution::completion_signatures<Sigs...>>
+{
+    static_assert((std::size_t(value_of<Sigs>::value) + ... + 0) == 1,
+        "as_awaitable needs exactly one set_value signature");
+
+    static constexpr std::size_t
+    find() noexcept
     {
-        std::exception_ptr ep_;
+        constexpr bool is_value[] = {value_of<Sigs>::value...};
+        std::size_t i = 0;
+        while(!is_value[i])
+            ++i;
+        return i;
+    }
 
-        std::exception_ptr exception() const noexcept { return ep_; }
+    using type = typename value_of<
+        std::tuple_element_t<find(), std::tuple<Sigs...>>>::type;
+};
 
-        task get_return_object()
-        {
-            return task{std::coroutine_handle<promise_type>::from_promise(*this)};
-        }
+template<class E>
+std::exception_ptr
+to_exception_ptr(E&& e) noexcept
+{
+    if constexpr (std::same_as<std::decay_t<E>, std::exception_ptr>)
+        return std::forward<E>(e);
+    else if constexpr (std::same_as<std::decay_t<E>, std::error_code>)
+        return std::make_exception_ptr(std::system_error(e));
+    else
+        return std::make_exception_ptr(std::forward<E>(e));
+}
 
-        auto initial_suspend() noexcept
-        {
-            struct awaiter
-            {
-                promise_type* p_;
+// A memory_resource over an arbitrary allocator, in units of
+// std::max_align_t, which is all a frame asks for
+template<class Alloc>
+class allocator_resource : public std::pmr::memory_resource
+{
+    using unit = std::max_align_t;
+    using alloc_type = typename std::allocator_traits<Alloc>::template rebind_alloc<unit>;
+    using traits = std::allocator_traits<alloc_type>;
 
-                bool await_ready() const noexcept { return false; }
+    alloc_type a_;
 
-                void await_suspend(std::coroutine_handle<>) const noexcept
-                {
-                }
+    static std::size_t
+    units(std::size_t n) noexcept
+    {
+        return (n + sizeof(unit) - 1) / sizeof(unit);
+    }
 
-                void await_resume() const noexcept
-                {
-                    auto* fa = p_->environment()->allocator;
-                    if(fa && fa != current_frame_allocator())
-                        current_frame_allocator() = fa;
-                }
-            };
-            return awaiter{this};
-        }
+public:
+    explicit
+    allocator_resource(Alloc const& a) noexcept
+        : a_(a)
+    {
+    }
 
-        auto final_suspend() noexcept
-        {
-            struct awaiter
-            {
-                promise_type* p_;
+private:
+    void*
+    do_allocate(std::size_t n, std::size_t) override
+    {
+        return traits::allocate(a_, units(n));
+    }
 
-                bool await_ready() const noexcept { return false; }
+    void
+    do_deallocate(void* p, std::size_t n, std::size_t) noexcept override
+    {
+        traits::deallocate(a_, static_cast<unit*>(p), units(n));
+    }
 
-                std::coroutine_handle<> await_suspend(std::coroutine_handle<>) const noexcept
-                {
-                    return p_->continuation();
-                }
+    bool
+    do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+    {
+        return this == &other;
+    }
+};
 
-                void await_resume() const noexcept {}
-            };
-            return awaiter{this};
-        }
+template<class A>
+struct is_polymorphic_allocator : std::false_type {};
 
-        void unhandled_exception()
-        {
-            ep_ = std::current_exception();
-        }
+template<class U>
+struct is_polymorphic_allocator<std::pmr::polymorphic_allocator<U>> : std::true_type {};
 
-        template<class Awaitable>
-        struct transform_awaiter
-        {
-            std::decay_t<Awaitable> a_;
-            promise_type* p_;
+template<class Env>
+using env_allocator_t = decltype(execution::get_allocator(std::declval<Env const&>()));
 
-            bool await_ready() noexcept { return a_.await_ready(); }
+// Where a bridged task's frames come from: the memory_resource of a
+// polymorphic_allocator in the receiver's environment, any other
+// allocator found there behind an adaptor stored in place, or else
+// the executor's context default
+template<class Env>
+class frame_resource
+{
+    std::pmr::memory_resource* mr_;
 
-            decltype(auto) await_resume()
-            {
-                auto* fa = p_->environment()->allocator;
-                if(fa && fa != current_frame_allocator())
-                    current_frame_allocator() = fa;
-                return a_.await_resume();
-            }
+public:
+    frame_resource(Env const& env, std::pmr::memory_resource* fallback) noexcept
+        : mr_(fallback)
+    {
+        if constexpr (requires { execution::get_allocator(env); })
+            mr_ = execution::get_allocator(env).resource();
+    }
 
-            template<class Promise>
-            auto await_suspend(std::coroutine_handle<Promise> h) noexcept
-            {
-                return a_.await_suspend(h, p_->environment());
-            }
-        };
+    std::pmr::memory_resource* get() noexcept { return mr_; }
+};
 
-        template<class Awaitable>
-        auto transform_awaitable(Awaitable&& a)
-        {
-            using A = std::decay_t<Awaitable>;
-            if constexpr (IoAwaitable<A>)
-            {
-                return transform_awaiter<Awaitable>{
-                    std::forward<Awaitable>(a), this};
-            }
-            else
-            {
-                static_assert(sizeof(A) == 0, "requires IoAwaitable");
-            }
-        }
-    };
+template<class Env>
+    requires requires(Env const& env) { execution::get_allocator(env); } &&
+        (!is_polymorphic_allocator<env_allocator_t<Env>>::value)
+class frame_resource<Env>
+{
+    allocator_resource<env_allocator_t<Env>> res_;
 
-    std::coroutine_handle<promise_type> h_;
+public:
+    frame_resource(Env const& env, std::pmr::memory_resource*) noexcept
+        : res_(execution::get_allocator(env))
+    {
+    }
 
-    ~task()
+    std::pmr::memory_resource* get() noexcept { return &res_; }
+};
+
+// Operation state of as_sender. The receiver, the io_env and the
+// task are all members, so connecting allocates nothing beyond the
+// task's own frame, which comes from the receiver's allocator.
+template<class Ex, class Task, class Receiver>
+class task_operation : task_completion
+{
+    using env_type = decltype(execution::get_env(std::declval<Receiver const&>()));
+    using token_type = decltype(execution::get_stop_token(std::declval<env_type const&>()));
+
+    Receiver rcvr_;
+    Ex ex_;
+    stop_bridge<token_type> stop_;
+    frame_resource<env_type> mr_;
+    io_env env_;
+    Task t_;
+
+    template<class Factory>
+    static Task
+    make(std::pmr::memory_resource* mr, Factory& f)
     {
-        if(h_)
-            h_.destroy();
+        frame_allocator_scope scope(mr);
+        return f();
     }
 
-    bool await_ready() const noexcept { return false; }
+    // The receiver may destroy this operation, and the suspended
+    // frame with it, before returning
+    static std::coroutine_handle<>
+    complete(task_completion* c) noexcept
+    {
+        auto* self = static_cast<task_operation*>(c);
+        auto& p = self->t_.handle().promise();
+        if(auto ep = p.exception())
+        {
+            std::move(self->rcvr_).set_error(std::move(ep));
+        }
+        else
+        {
+            if constexpr (std::is_void_v<typename Task::result_type>)
+                std::move(self->rcvr_).set_value();
+            else
+                std::move(self->rcvr_).set_value(std::move(p.result()));
+        }
+        return std::noop_coroutine();
+    }
+
+public:
+    using operation_state_concept = execution::operation_state_t;
 
-    auto await_resume()
+    template<class Factory>
+    task_operation(Ex const& ex, Factory& f, Receiver r)
+        : task_completion{&complete}
+        , rcvr_(std::move(r))
+        , ex_(ex)
+        , stop_(execution::get_stop_token(execution::get_env(rcvr_)))
+        , mr_(execution::get_env(rcvr_), ex_.context().get_frame_allocator())
+        , env_{executor_ref(ex_), stop_.get_token(), mr_.get()}
+        , t_(make(mr_.get(), f))
     {
-        if(h_.promise().ep_)
-            std::rethrow_exception(h_.promise().ep_);
-        if constexpr (! std::is_void_v<T>)
-            return std::move(*h_.promise().result_);
-        else
-            return;
+#if CAPY_TRACING
+        env_.tracer = ex_.context().tracer();
+#endif
     }
 
-    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont, io_env const* env)
+    task_operation(task_operation const&) = delete;
+    task_operation& operator=(task_operation const&) = delete;
+
+    // Runs inline when start() is called on the executor
+    void
+    start() & noexcept
     {
-        h_.promise().set_continuation(cont);
-        h_.promise().set_environment(env);
-        return h_;
+        auto h = t_.handle();
+        h.promise().set_environment(&env_);
+        h.promise().set_completion(this);
+        frame_allocator_scope scope(current_frame_allocator());
+        env_.executor.dispatch(h).resume();
     }
+};
 
-    std::coroutine_handle<promise_type> handle() const noexcept { return h_; }
+template<class Ex, class Factory>
+class task_sender
+{
+    using task_type = std::invoke_result_t<Factory&>;
+    using result_type = typename task_type::result_type;
 
-    void release() noexcept { h_ = nullptr; }
+    Ex ex_;
+    Factory f_;
 
-    task(task const&) = delete;
-    task& operator=(task const&) = delete;
+public:
+    using sender_concept = execution::sender_t;
+    using completion_signatures = std::conditional_t<std::is_void_v<result_type>,
+        execution::completion_signatures<
+            execution::set_value_t(),
+            execution::set_error_t(std::exception_ptr)>,
+        execution::completion_signatures<
+            execution::set_value_t(combinator_result_t<result_type>),
+            execution::set_error_t(std::exception_ptr)>>;
 
-    task(task&& other) noexcept
-        : h_(std::exchange(other.h_, nullptr))
+    task_sender(Ex const& ex, Factory f)
+        : ex_(ex)
+        , f_(std::move(f))
     {
     }
 
-    task& operator=(task&& other) noexcept
+    template<class Receiver>
+    task_operation<Ex, task_type, Receiver>
+    connect(Receiver r) &&
     {
-        if(this != &other)
+        return task_operation<Ex, task_type, Receiver>(ex_, f_, std::move(r));
+    }
+};
+
+// Awaiter of as_awaitable. The sender's operation state is built in
+// place inside the awaiter, in the awaiting coroutine's frame, and
+// the receiver's environment hands the sender the io_env's stop
+// token and frame allocator.
+template<class Sender>
+class sender_awaiter
+{
+    using value_type = typename sender_value<typename Sender::completion_signatures>::type;
+    using stored_type = combinator_result_t<value_type>;
+
+    struct env
+    {
+        io_env const* e;
+
+        inplace_stop_token
+        query(execution::get_stop_token_t) const noexcept
         {
-            if(h_)
-                h_.destroy();
-            h_ = std::exchange(other.h_, nullptr);
+            return e->stop_token;
         }
-        return *this;
-    }
 
-private:
-    explicit task(std::coroutine_handle<promise_type> h)
-        : h_(h)
+        std::pmr::polymorphic_allocator<std::byte>
+        query(execution::get_allocator_t) const noexcept
+        {
+            return e->allocator ? e->allocator : std::pmr::get_default_resource();
+        }
+    };
+
+    struct receiver
     {
-    }
-};
+        using receiver_concept = execution::receiver_t;
 
-// ============================================================
-// Concept satisfaction checks
-// ============================================================
+        sender_awaiter* self;
 
-static_assert(IoAwaitable<task<int>>);
-static_assert(IoRunnable<task<int>>);
-static_assert(IoAwaitable<task<>>);
-static_assert(IoRunnable<task<>>);
+        template<class... Vs>
+        void
+        set_value(Vs&&... vs) && noexcept
+        {
+            try
+            {
+                if constexpr (std::is_void_v<value_type>)
+                    self->result_.emplace();
+                else
+                    self->result_.emplace(std::forward<Vs>(vs)...);
+            }
+            catch(...)
+            {
+                self->ep_ = std::current_exception();
+            }
+            self->finish();
+        }
 
-// ============================================================
-// inline_executor — trivial synchronous executor for demo
-// ============================================================
+        template<class E>
+        void
+        set_error(E&& e) && noexcept
+        {
+            self->ep_ = to_exception_ptr(std::forward<E>(e));
+            self->finish();
+        }
 
-struct inline_context : execution_context {};
+        void
+        set_stopped() && noexcept
+        {
+            self->ep_ = std::make_exception_ptr(std::system_error(
+                std::make_error_code(std::errc::operation_canceled)));
+            self->finish();
+        }
 
-struct inline_executor
-{
-    inline_context* ctx_;
+        env get_env() const noexcept { return {self->env_}; }
+    };
 
-    execution_context& context() const noexcept { return *ctx_; }
-    void on_work_started() const noexcept {}
-    void on_work_finished() const noexcept {}
+    using op_type = decltype(std::declval<Sender>().connect(std::declval<receiver>()));
 
-    std::coroutine_handle<> dispatch(std::coroutine_handle<> h) const
+    Sender sndr_;
+    alignas(op_type) unsigned char op_[sizeof(op_type)];
+    bool connected_ = false;
+    std::atomic<bool> done_{false};
+    std::optional<stored_type> result_;
+    std::exception_ptr ep_;
+    std::coroutine_handle<> h_;
+    io_env const* env_ = nullptr;
+
+    // Whichever of await_suspend and the completion comes second
+    // resumes the coroutine, so a sender that completes inside
+    // start() does not nest a resume in await_suspend
+    void
+    finish() noexcept
     {
-        return h;
+        if(done_.exchange(true, std::memory_order_acq_rel))
+            env_->executor.dispatch(h_).resume();
     }
 
-    void post(std::coroutine_handle<> h) const
+public:
+    explicit
+    sender_awaiter(Sender s)
+        : sndr_(std::move(s))
     {
-        h.resume();
     }
 
-    bool operator==(inline_executor const& other) const noexcept
+    // Moved only before the operation starts
+    sender_awaiter(sender_awaiter&& other)
+        : sndr_(std::move(other.sndr_))
     {
-        return ctx_ == other.ctx_;
     }
-};
 
-static_assert(Executor<inline_executor>);
+    ~sender_awaiter()
+    {
+        if(connected_)
+            std::launder(reinterpret_cast<op_type*>(op_))->~op_type();
+    }
 
-// ============================================================
-// Minimal run_sync — synchronous launcher for demonstration
-// ============================================================
+    bool await_ready() const noexcept { return false; }
 
-template<IoRunnable Task>
-auto run_sync(executor_ref ex, std::stop_token token, Task t)
-{
-    auto h = t.handle();
-    auto& p = h.promise();
-    io_env env{ex, token};
-    p.set_environment(&env);
-    // No continuation — cont_ defaults to noop_coroutine()
-    t.release();
-    h.resume();
+    bool
+    await_suspend(std::coroutine_handle<> h, io_env const* e)
+    {
+        h_ = h;
+        env_ = e;
+        auto* op = ::new(static_cast<void*>(op_)) op_type(
+            std::move(sndr_).connect(receiver{this}));
+        connected_ = true;
+        op->start();
+        return !done_.exchange(true, std::memory_order_acq_rel);
+    }
 
-    if(p.exception())
-        std::rethrow_exception(p.exception());
+    value_type
+    await_resume()
+    {
+        if(ep_)
+            std::rethrow_exception(ep_);
+        if constexpr (!std::is_void_v<value_type>)
+            return std::move(*result_);
+    }
+};
 
-    if constexpr (!std::is_void_v<decltype(t.await_resume())>)
-        return p.result();
+} // namespace detail
+
+// A sender running the task that factory returns on ex. The frame
+// is created at connect(), with the receiver's allocator installed
+// as the frame allocator, and the receiver's stop token reaches the
+// task through its io_env.
+template<Executor Ex, class Factory>
+    requires IoRunnable<std::invoke_result_t<Factory&>>
+auto
+as_sender(Ex const& ex, Factory factory)
+{
+    return detail::task_sender<Ex, Factory>(ex, std::move(factory));
 }
 
-template<IoRunnable Task>
-auto run_sync(executor_ref ex, Task t)
+// A sender for a task whose frame already exists. Only the task's
+// own frame misses the receiver's allocator; its children use it.
+template<Executor Ex, class T, class FrameAllocator>
+auto
+as_sender(Ex const& ex, task<T, FrameAllocator> t)
 {
-    return run_sync(ex, std::stop_token{}, std::move(t));
+    return as_sender(ex, [t = std::move(t)]() mutable { return std::move(t); });
+}
+
+// Await a sender from a task. Values arrive as the single value,
+// a tuple of several, or nothing; an error is rethrown, and
+// set_stopped surfaces as std::system_error(operation_canceled).
+template<class Sender>
+    requires requires { typename std::decay_t<Sender>::completion_signatures; }
+auto
+as_awaitable(Sender&& sndr)
+{
+    return detail::sender_awaiter<std::decay_t<Sender>>(std::forward<Sender>(sndr));
 }
 
 // ============================================================
@@ -644,6 +7520,15 @@ task<int> parent_task()
     co_return a + b;
 }
 
+// Fan-out: children run concurrently on the propagated executor
+task<int> fan_out_task()
+{
+    auto [a, b] = co_await when_all(compute(3), compute(7));
+    auto first = co_await when_any(compute(1), compute(2));
+    std::printf("fan_out_task: when_any winner=%zu\n", first.index());
+    co_return a + b;
+}
+
 // Void task
 task<> void_task()
 {
@@ -653,6 +7538,365 @@ task<> void_task()
     co_return;
 }
 
+// Checks print their outcome; any failure makes main return 1
+int demo_failures = 0;
+
+void
+check(bool ok, char const* what)
+{
+    std::printf("  %s: %s\n", what, ok ? "ok" : "FAILED");
+    if(!ok)
+        ++demo_failures;
+}
+
+// Drives a timing wheel the way the timer thread does, jumping
+// straight to next_due(), with timers on both sides of the 64 and
+// 4096 tick boundaries. Each must fire exactly at its expiry.
+void
+wheel_checks()
+{
+    std::uint64_t const expiries[] = {63, 64, 127, 130, 200, 4095, 4097, 4200};
+    constexpr std::size_t n = std::size(expiries);
+    detail::timer_node nodes[n];
+    std::uint64_t fired[n] = {};
+    detail::timing_wheel wheel;
+    for(std::size_t i = 0; i < n; ++i)
+    {
+        nodes[i].expiry = expiries[i];
+        wheel.insert(&nodes[i]);
+    }
+    while(!wheel.empty())
+    {
+        auto t = wheel.next_due();
+        for(auto* p = wheel.advance(t); p; p = p->next)
+            fired[p - nodes] = t;
+    }
+    bool on_time = true;
+    for(std::size_t i = 0; i < n; ++i)
+        on_time = on_time && fired[i] == expiries[i];
+    check(on_time, "timers across wheel boundaries fire at their expiry");
+}
+
+// Resumes the awaiting coroutine through its executor's queue
+struct reschedule
+{
+    bool await_ready() const noexcept { return false; }
+
+    void
+    await_suspend(std::coroutine_handle<> h, io_env const* env) const
+    {
+        env->executor.post(h);
+    }
+
+    void await_resume() const noexcept {}
+};
+
+static_assert(IoAwaitable<reschedule>);
+
+task<> acquire_in_order(async_semaphore& sem, std::vector<int>& order, int id)
+{
+    auto ec = co_await sem.acquire();
+    if(!ec)
+        order.push_back(id);
+}
+
+task<> release_three(async_semaphore& sem, bool& handed_over)
+{
+    sem.release(3);
+    // Every unit went straight to a waiter, none to the count
+    handed_over = !sem.try_acquire();
+    co_return;
+}
+
+task<int> acquire_or_cancel(async_semaphore& sem, std::error_code& ec)
+{
+    ec = co_await sem.acquire();
+    co_return 0;
+}
+
+task<int> finish_now()
+{
+    co_return 1;
+}
+
+// The last child of when_any starts first and queues on sem; the
+// first then wins, and the stop request takes the waiter off the list
+task<> cancel_queued(async_semaphore& sem, std::error_code& ec, std::size_t& winner)
+{
+    auto r = co_await when_any(finish_now(), acquire_or_cancel(sem, ec));
+    winner = r.index();
+}
+
+task<> locked_section(async_mutex& m, int& inside, int& overlaps)
+{
+    co_await m.lock();
+    if(++inside > 1)
+        ++overlaps;
+    co_await reschedule{};
+    --inside;
+    m.unlock();
+}
+
+task<> produce_then_close(channel<int>& ch, std::error_code& late)
+{
+    for(int i = 1; i <= 3; ++i)
+        co_await ch.send(i);
+    ch.close();
+    late = co_await ch.send(4);
+}
+
+task<> drain(channel<int>& ch, std::vector<int>& got, std::error_code& end)
+{
+    for(;;)
+    {
+        auto [ec, v] = co_await ch.receive();
+        if(ec)
+        {
+            end = ec;
+            co_return;
+        }
+        got.push_back(*v);
+    }
+}
+
+// The sender logs -v once send(v) completes, the receiver logs v
+task<> rendezvous_send(channel<int>& ch, std::vector<int>& log)
+{
+    for(int v : {42, 43})
+    {
+        co_await ch.send(v);
+        log.push_back(-v);
+    }
+}
+
+task<> rendezvous_receive(channel<int>& ch, std::vector<int>& log)
+{
+    for(int i = 0; i < 2; ++i)
+    {
+        auto [ec, v] = co_await ch.receive();
+        if(!ec)
+            log.push_back(*v);
+    }
+}
+
+void
+sync_checks()
+{
+    io_context ioc;
+    auto ex = ioc.get_executor();
+
+    {
+        async_semaphore sem;
+        std::vector<int> order;
+        bool handed_over = false;
+        for(int id = 0; id < 3; ++id)
+            spawn(ex, acquire_in_order(sem, order, id));
+        spawn(ex, release_three(sem, handed_over));
+        ioc.run();
+        check(order == std::vector<int>{0, 1, 2}, "semaphore wakes waiters in FIFO order");
+        check(handed_over, "semaphore hands released units to waiters");
+    }
+
+    {
+        async_semaphore sem;
+        std::error_code ec;
+        std::size_t winner = 1;
+        spawn(ex, cancel_queued(sem, ec, winner));
+        ioc.run();
+        check(winner == 0 && ec == std::errc::operation_canceled,
+            "stop request cancels a queued waiter");
+        sem.release();
+        check(sem.try_acquire(), "cancelled waiter leaves the queue");
+    }
+
+    {
+        async_mutex m;
+        int inside = 0;
+        int overlaps = 0;
+        for(int i = 0; i < 3; ++i)
+            spawn(ex, locked_section(m, inside, overlaps));
+        ioc.run();
+        check(overlaps == 0 && m.try_lock(), "mutex excludes across a suspension");
+    }
+
+    {
+        channel<int> ch(4);
+        std::vector<int> got;
+        std::error_code late;
+        std::error_code end;
+        spawn(ex, produce_then_close(ch, late));
+        spawn(ex, drain(ch, got, end));
+        ioc.run();
+        check(got == std::vector<int>{1, 2, 3} && end == std::errc::broken_pipe,
+            "receivers drain a closed channel, then fail");
+        check(late == std::errc::broken_pipe, "send after close fails");
+    }
+
+    {
+        // With no buffer, the second send waits for the second
+        // receive; a buffered channel would log -42, -43, 42, 43
+        channel<int> ch(0);
+        std::vector<int> log;
+        spawn(ex, rendezvous_receive(ch, log));
+        spawn(ex, rendezvous_send(ch, log));
+        ioc.run();
+        check(log == std::vector<int>{-42, 42, 43, -43}, "rendezvous channel hands over directly");
+    }
+}
+
+// A foreign sender that completes inside start()
+struct just_int
+{
+    using sender_concept = execution::sender_t;
+    using completion_signatures = execution::completion_signatures<
+        execution::set_value_t(int)>;
+
+    template<class Receiver>
+    struct operation
+    {
+        Receiver r;
+        int v;
+
+        void start() & noexcept { std::move(r).set_value(v); }
+    };
+
+    int v;
+
+    template<class Receiver>
+    operation<Receiver>
+    connect(Receiver r) &&
+    {
+        return {std::move(r), v};
+    }
+};
+
+task<int> pool_answer(thread_pool& tp, bool& on_pool)
+{
+    on_pool = tp.running_in_this_thread();
+    co_return 42;
+}
+
+// The second sender completes on a pool thread, and the awaiting
+// coroutine comes back through its own executor
+task<> await_senders(io_context& ioc, thread_pool& tp,
+    int& inline_value, int& pool_value, bool& on_pool, bool& back_home)
+{
+    inline_value = co_await as_awaitable(just_int{5});
+    pool_value = co_await as_awaitable(
+        as_sender(tp.get_executor(), pool_answer(tp, on_pool)));
+    back_home = ioc.running_in_this_thread();
+}
+
+void
+sender_checks()
+{
+    io_context ioc;
+    thread_pool tp(1);
+    int inline_value = 0;
+    int pool_value = 0;
+    bool on_pool = false;
+    bool back_home = false;
+    spawn(ioc.get_executor(), await_senders(ioc, tp,
+        inline_value, pool_value, on_pool, back_home));
+
+    // The pool keeps running until the io_context is done with it
+    tp.get_executor().on_work_started();
+    std::thread pool_thread([&tp] { tp.run(); });
+    ioc.run();
+    tp.get_executor().on_work_finished();
+    pool_thread.join();
+
+    check(inline_value == 5, "sender completing inside start() resumes inline");
+    check(pool_value == 42 && on_pool, "task sender runs on its executor");
+    check(back_home, "async sender completion resumes on the awaiting executor");
+}
+
+#if CAPY_HAS_IO_URING
+
+struct shard_results
+{
+    std::atomic<int> started_home{0};
+    std::atomic<int> hopped{0};
+    std::atomic<int> returned_home{0};
+    std::atomic<int> notes{0};
+    std::atomic<int> remaining{0};      // shard tasks plus notes
+};
+
+void
+finish_one(sharded_runtime& rt, shard_results& r)
+{
+    if(--r.remaining == 0)
+        rt.request_stop();
+}
+
+task<> shard_note(sharded_runtime& rt, std::size_t i, shard_results& r)
+{
+    if(rt.context(i).running_in_this_thread())
+        ++r.notes;
+    finish_one(rt, r);
+    co_return;
+}
+
+task<bool> on_shard(sharded_runtime& rt, std::size_t i)
+{
+    co_return rt.context(i).running_in_this_thread();
+}
+
+// Hops to the next shard and back, then hands it a note
+task<> shard_main(sharded_runtime& rt, std::size_t i, shard_results& r)
+{
+    if(rt.context(i).running_in_this_thread())
+        ++r.started_home;
+    auto j = (i + 1) % rt.size();
+    bool there = co_await run_on(rt.executor(j), on_shard(rt, j));
+    if(there)
+        ++r.hopped;
+    if(rt.context(i).running_in_this_thread())
+        ++r.returned_home;
+    rt.post(j, shard_note(rt, j, r));
+    finish_one(rt, r);
+}
+
+struct start_shard_main
+{
+    shard_results* r;
+
+    task<>
+    operator()(sharded_runtime& rt, std::size_t i) const
+    {
+        return shard_main(rt, i, *r);
+    }
+};
+
+void
+shard_checks()
+{
+    sharded_runtime rt({2, {}, {}});
+    int n = static_cast<int>(rt.size());
+    shard_results r;
+    r.remaining = 2 * n;
+    rt.spawn_each(start_shard_main{&r});
+    // Returns once the last note has called request_stop()
+    rt.run();
+    check(r.started_home == n, "spawn_each starts a task on every shard");
+    check(r.hopped == n && r.returned_home == n, "run_on hops between shards and back");
+    check(r.notes == n, "post hands a task to another shard");
+
+    // With nothing to run, the shards wait for request_stop()
+    sharded_runtime idle({2, {}, {}});
+    std::atomic<bool> stopped{false};
+    std::thread stopper([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        stopped = true;
+        idle.request_stop();
+    });
+    idle.run();
+    check(stopped, "request_stop ends run() when every shard is idle");
+    stopper.join();
+}
+
+#endif // CAPY_HAS_IO_URING
+
 int main()
 {
     inline_context ctx;
@@ -662,6 +7906,20 @@ int main()
     int result = run_sync(ex, parent_task());
     std::printf("result = %d\n\n", result);
 
+    std::printf("--- Running fan_out_task ---\n");
+    result = run_sync(ex, fan_out_task());
+    std::printf("result = %d\n\n", result);
+
+    std::printf("--- Running parent_task in a request arena ---\n");
+    {
+        // Every frame, the root included, comes from the arena
+        std::byte buffer[4096];
+        request_arena arena(buffer, sizeof(buffer));
+        result = run_sync(ex, std::stop_token{}, arena,
+            [] { return parent_task(); });
+        std::printf("result = %d\n\n", result);
+    }
+
     std::printf("--- Running void_task with stop token ---\n");
     std::stop_source source;
     run_sync(ex, source.get_token(), void_task());
@@ -670,6 +7928,25 @@ int main()
     source.request_stop();
     run_sync(ex, source.get_token(), void_task());
 
+    std::printf("\n--- Timing wheel ---\n");
+    wheel_checks();
+
+    std::printf("\n--- Coroutine synchronization on an io_context ---\n");
+    sync_checks();
+
+    std::printf("\n--- Sender bridge ---\n");
+    sender_checks();
+
+#if CAPY_HAS_IO_URING
+    std::printf("\n--- Sharded runtime ---\n");
+    shard_checks();
+#endif
+
+    if(demo_failures)
+    {
+        std::printf("\n%d checks FAILED.\n", demo_failures);
+        return 1;
+    }
     std::printf("\nAll concept checks passed. Protocol works.\n");
     return 0;
 }
@@ -677,4 +7954,6 @@ int main()
 } // namespace capy
 
 // Trampoline main
+#ifndef CAPY_NO_DEMO_MAIN
 int main() { return capy::main(); }
+#endif